@@ -0,0 +1,450 @@
+#include <inttypes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "pupdmd.h"
+
+// Counts every allocation of the process. On platforms without symbol interposition for shared libraries (Windows)
+// only the allocations of the benchmark itself are seen.
+static std::atomic<uint64_t> s_allocations = 0;
+
+void* operator new(size_t size)
+{
+  s_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void* p) noexcept { free(p); }
+
+void operator delete[](void* p) noexcept { free(p); }
+
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+struct Options
+{
+  uint16_t triggers = 200;
+  uint32_t frames = 20000;
+  double hitRate = 0.5;
+  double maskRate = 0.7;
+  uint32_t seed = 1;
+  PUPDMD::RegionHashing regionHashing = PUPDMD::RegionHashing::Komihash;
+  std::string dir;
+};
+
+struct Resolution
+{
+  uint16_t width = 0;
+  uint16_t height = 0;
+};
+
+static constexpr Resolution s_resolutions[] = {{128, 16}, {128, 32}, {192, 64}, {256, 64}};
+
+// Red levels of a typical orange DMD, PUPDMD_MASK_R must not appear in frame content.
+static constexpr uint8_t s_levels[] = {0, 0, 0, 10, 30, 50, 60, 80, 100, 120, 130, 150, 170, 190, 200, 220, 230, 250};
+
+// Same defaults as the library, used to build the indexed frames a pinmame core would deliver.
+static constexpr uint8_t s_thresholds2[] = {8, 48, 128};
+static constexpr uint8_t s_thresholds4[] = {8, 24, 48, 56, 72, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240};
+
+struct Capture
+{
+  uint16_t triggerID = 0;
+  Resolution resolution;
+  bool mask = false;
+  uint8_t maskX = 0;
+  uint8_t maskY = 0;
+  uint8_t maskWidth = 0;
+  uint8_t maskHeight = 0;
+  std::vector<uint8_t> rgb;
+};
+
+// Distinct frames generated per resolution. Longer streams cycle through them, so memory does not grow with --frames.
+static constexpr uint32_t s_streamPoolFrames = 256;
+
+struct Stream
+{
+  Resolution resolution;
+  std::vector<uint8_t> rgb;
+  std::vector<uint8_t> indexed;
+  uint32_t poolFrames = 0;  // frames stored in rgb and indexed
+  uint32_t frameCount = 0;  // frames matched, frame i is pool frame i % poolFrames
+};
+
+static void PutPixel(std::vector<uint8_t>& rgb, uint16_t width, int x, int y, uint8_t r, uint8_t g, uint8_t b)
+{
+  uint8_t* pPixel = &rgb[(y * width + x) * 3];
+  pPixel[0] = r;
+  pPixel[1] = g;
+  pPixel[2] = b;
+}
+
+static void RandomPixels(std::vector<uint8_t>& rgb, std::mt19937& rng)
+{
+  std::uniform_int_distribution<size_t> level(0, sizeof(s_levels) - 1);
+  for (size_t i = 0; i < rgb.size(); i += 3)
+  {
+    const uint8_t r = s_levels[level(rng)];
+    rgb[i] = r;
+    rgb[i + 1] = (uint8_t)(r * 55 / 100);
+    rgb[i + 2] = (uint8_t)(r / 10);
+  }
+}
+
+static bool WriteBMP(const std::filesystem::path& path, const Capture& capture)
+{
+  const uint16_t width = capture.resolution.width;
+  const uint16_t height = capture.resolution.height;
+
+  PUPDMD::BMPHeader header;
+  memset(&header, 0, sizeof(header));
+  header.signature[0] = 'B';
+  header.signature[1] = 'M';
+  header.dataOffset = sizeof(header);
+  header.headerSize = 40;
+  header.width = width;
+  header.height = height;
+  header.planes = 1;
+  header.bpp = 24;
+  header.imageSize = width * height * 3;
+  header.fileSize = header.dataOffset + header.imageSize;
+
+  // BMP starts at the lower left and stores BGR.
+  std::vector<uint8_t> pixelData(header.imageSize);
+  for (int y = 0; y < height; y++)
+  {
+    const uint8_t* pRow = &capture.rgb[(height - 1 - y) * width * 3];
+    uint8_t* pOut = &pixelData[y * width * 3];
+    for (int x = 0; x < width; x++)
+    {
+      pOut[x * 3] = pRow[x * 3 + 2];
+      pOut[x * 3 + 1] = pRow[x * 3 + 1];
+      pOut[x * 3 + 2] = pRow[x * 3];
+    }
+  }
+
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(pixelData.data()), pixelData.size());
+  return file.good();
+}
+
+static std::vector<Capture> GenerateCaptures(const Options& options, std::mt19937& rng)
+{
+  std::uniform_int_distribution<size_t> resolution(0, sizeof(s_resolutions) / sizeof(s_resolutions[0]) - 1);
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+
+  std::vector<Capture> captures;
+  for (uint16_t triggerID = 1; triggerID <= options.triggers; triggerID++)
+  {
+    Capture capture;
+    capture.triggerID = triggerID;
+    capture.resolution = s_resolutions[resolution(rng)];
+    const uint16_t width = capture.resolution.width;
+    const uint16_t height = capture.resolution.height;
+
+    capture.rgb.resize(width * height * 3);
+    RandomPixels(capture.rgb, rng);
+
+    capture.mask = chance(rng) < options.maskRate;
+    if (capture.mask)
+    {
+      // The magenta outline surrounds the region, so it needs one pixel on every side.
+      capture.maskWidth = std::uniform_int_distribution<int>(4, width / 2)(rng);
+      capture.maskHeight = std::uniform_int_distribution<int>(3, height / 2)(rng);
+      capture.maskX = std::uniform_int_distribution<int>(1, width - capture.maskWidth - 1)(rng);
+      capture.maskY = std::uniform_int_distribution<int>(1, height - capture.maskHeight - 1)(rng);
+
+      for (int x = capture.maskX - 1; x <= capture.maskX + capture.maskWidth; x++)
+      {
+        PutPixel(capture.rgb, width, x, capture.maskY - 1, PUPDMD_MASK_R, PUPDMD_MASK_G, PUPDMD_MASK_B);
+        PutPixel(capture.rgb, width, x, capture.maskY + capture.maskHeight, PUPDMD_MASK_R, PUPDMD_MASK_G,
+                 PUPDMD_MASK_B);
+      }
+      for (int y = capture.maskY - 1; y <= capture.maskY + capture.maskHeight; y++)
+      {
+        PutPixel(capture.rgb, width, capture.maskX - 1, y, PUPDMD_MASK_R, PUPDMD_MASK_G, PUPDMD_MASK_B);
+        PutPixel(capture.rgb, width, capture.maskX + capture.maskWidth, y, PUPDMD_MASK_R, PUPDMD_MASK_G,
+                 PUPDMD_MASK_B);
+      }
+    }
+
+    captures.push_back(std::move(capture));
+  }
+
+  return captures;
+}
+
+static void Quantize(const uint8_t* pRGB, uint8_t* pIndexed, size_t pixels, uint8_t bitDepth)
+{
+  const uint8_t* pThresholds = bitDepth == 4 ? s_thresholds4 : s_thresholds2;
+  const uint8_t count = (1 << bitDepth) - 1;
+  for (size_t i = 0; i < pixels; i++)
+  {
+    uint8_t index = 0;
+    while (index < count && pRGB[i * 3] >= pThresholds[index]) index++;
+    pIndexed[i] = index;
+  }
+}
+
+// Frames of one resolution. A hit is a capture of that resolution with new content outside of its mask region, a
+// miss is random content.
+static Stream GenerateStream(const Options& options, const std::vector<Capture>& captures, Resolution resolution,
+                             uint8_t bitDepth, std::mt19937& rng)
+{
+  std::vector<const Capture*> candidates;
+  for (const auto& capture : captures)
+  {
+    if (capture.resolution.width == resolution.width && capture.resolution.height == resolution.height)
+      candidates.push_back(&capture);
+  }
+
+  Stream stream;
+  stream.resolution = resolution;
+  stream.frameCount = options.frames;
+  stream.poolFrames = std::min(options.frames, s_streamPoolFrames);
+
+  const size_t pixels = resolution.width * resolution.height;
+  stream.rgb.resize(pixels * 3 * stream.poolFrames);
+  stream.indexed.resize(pixels * stream.poolFrames);
+
+  std::uniform_real_distribution<double> chance(0.0, 1.0);
+  std::vector<uint8_t> frame(pixels * 3);
+  for (uint32_t i = 0; i < stream.poolFrames; i++)
+  {
+    RandomPixels(frame, rng);
+    if (!candidates.empty() && chance(rng) < options.hitRate)
+    {
+      const Capture* pCapture =
+          candidates[std::uniform_int_distribution<size_t>(0, candidates.size() - 1)(rng)];
+      if (pCapture->mask)
+      {
+        for (int y = pCapture->maskY; y < pCapture->maskY + pCapture->maskHeight; y++)
+        {
+          const size_t offset = (y * resolution.width + pCapture->maskX) * 3;
+          memcpy(&frame[offset], &pCapture->rgb[offset], pCapture->maskWidth * 3);
+        }
+      }
+      else
+      {
+        frame = pCapture->rgb;
+      }
+    }
+
+    memcpy(&stream.rgb[i * pixels * 3], frame.data(), frame.size());
+    Quantize(frame.data(), &stream.indexed[i * pixels], pixels, bitDepth);
+  }
+
+  return stream;
+}
+
+static double Milliseconds(std::chrono::steady_clock::duration duration)
+{
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+static void BenchMatch(PUPDMD::DMD* pDmd, const Stream& stream, PUPDMD::MatchMode mode, bool first)
+{
+  const uint16_t width = stream.resolution.width;
+  const uint16_t height = stream.resolution.height;
+  const size_t frameSize = width * height * (mode == PUPDMD::MatchMode::Indexed ? 1 : 3);
+  const uint8_t* pFrames = mode == PUPDMD::MatchMode::Indexed ? stream.indexed.data() : stream.rgb.data();
+
+  auto match = [&](uint32_t i) -> uint16_t
+  {
+    i %= stream.poolFrames;
+    switch (mode)
+    {
+      case PUPDMD::MatchMode::ExactColor:
+        return pDmd->Match(&pFrames[i * frameSize], width, height, true);
+      case PUPDMD::MatchMode::Boolean:
+        return pDmd->Match(&pFrames[i * frameSize], width, height, false);
+      default:
+        return pDmd->MatchIndexed(&pFrames[i * frameSize], width, height);
+    }
+  };
+
+  // Warm up once, the first frame of a resolution sets up the session state.
+  match(0);
+
+  uint32_t triggers = 0;
+  pDmd->ResetStats();
+  const uint64_t allocations = s_allocations.load(std::memory_order_relaxed);
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < stream.frameCount; i++)
+  {
+    if (match(i)) triggers++;
+  }
+  const double ms = Milliseconds(std::chrono::steady_clock::now() - start);
+  const uint64_t allocated = s_allocations.load(std::memory_order_relaxed) - allocations;
+  const PUPDMD::Stats stats = pDmd->GetStats();
+
+  static const char* const s_modes[] = {"exactColor", "boolean", "indexed"};
+  printf("%s        {\"width\": %d, \"height\": %d, \"mode\": \"%s\", \"frames\": %u, \"triggers\": %u, "
+         "\"nsPerFrame\": %.1f, \"framesPerSecond\": %.0f, \"allocationsPerFrame\": %.3f, \"hashesPerFrame\": %.2f, "
+         "\"reusedHashesPerFrame\": %.2f, \"triggersScannedPerFrame\": %.2f}",
+         first ? "" : ",\n", width, height, s_modes[(int)mode], stream.frameCount, triggers,
+         ms * 1e6 / stream.frameCount, stream.frameCount / (ms / 1000.0), (double)allocated / stream.frameCount,
+         (double)stats.hashes[(int)mode] / stream.frameCount, (double)stats.reusedHashes / stream.frameCount,
+         (double)stats.triggersScanned / stream.frameCount);
+}
+
+static bool ParseOptions(int argc, const char* argv[], Options* pOptions)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc)
+    {
+      fprintf(stderr, "Missing value for %s\n", arg.c_str());
+      return false;
+    }
+
+    const char* value = argv[++i];
+    if (arg == "--triggers")
+    {
+      // Trigger IDs are 16 bit, larger values must not wrap around.
+      const long triggers = atol(value);
+      if (triggers < 1 || triggers > UINT16_MAX)
+      {
+        fprintf(stderr, "--triggers must be between 1 and %d\n", UINT16_MAX);
+        return false;
+      }
+      pOptions->triggers = (uint16_t)triggers;
+    }
+    else if (arg == "--frames")
+      pOptions->frames = (uint32_t)atoi(value);
+    else if (arg == "--hit-rate")
+      pOptions->hitRate = atof(value);
+    else if (arg == "--mask-rate")
+      pOptions->maskRate = atof(value);
+    else if (arg == "--seed")
+      pOptions->seed = (uint32_t)atoi(value);
+    else if (arg == "--dir")
+      pOptions->dir = value;
+    else if (arg == "--region-hashing" && (strcmp(value, "komihash") == 0 || strcmp(value, "prefix-sum") == 0))
+      pOptions->regionHashing =
+          value[0] == 'p' ? PUPDMD::RegionHashing::PrefixSum : PUPDMD::RegionHashing::Komihash;
+    else
+    {
+      fprintf(stderr, "Unknown option %s\n", arg.c_str());
+      return false;
+    }
+  }
+
+  if (pOptions->dir.empty()) pOptions->dir = (std::filesystem::temp_directory_path() / "pupdmd_bench").string();
+
+  return pOptions->triggers > 0 && pOptions->frames > 0;
+}
+
+int main(int argc, const char* argv[])
+{
+  Options options;
+  if (!ParseOptions(argc, argv, &options))
+  {
+    fprintf(stderr,
+            "Usage: pupdmd_bench [--triggers N] [--frames N] [--hit-rate 0..1] [--mask-rate 0..1] [--seed N] "
+            "[--region-hashing komihash|prefix-sum] [--dir path]\n");
+    return 1;
+  }
+
+  std::mt19937 rng(options.seed);
+  const std::vector<Capture> captures = GenerateCaptures(options, rng);
+
+  // <dir>/bench/PupCapture/<triggerID>.bmp
+  const std::filesystem::path captureDir = std::filesystem::path(options.dir) / "bench" / "PupCapture";
+  std::error_code ec;
+  std::filesystem::remove_all(captureDir, ec);
+  std::filesystem::create_directories(captureDir, ec);
+  for (const auto& capture : captures)
+  {
+    if (!WriteBMP(captureDir / (std::to_string(capture.triggerID) + ".bmp"), capture))
+    {
+      fprintf(stderr, "Error writing captures to %s\n", captureDir.string().c_str());
+      return 1;
+    }
+  }
+
+  printf("{\n  \"version\": \"%s\",\n", PUPDMD_VERSION);
+  printf("  \"config\": {\"triggers\": %u, \"frames\": %u, \"hitRate\": %.2f, \"maskRate\": %.2f, \"seed\": %u, "
+         "\"regionHashing\": \"%s\"},\n",
+         options.triggers, options.frames, options.hitRate, options.maskRate, options.seed,
+         options.regionHashing == PUPDMD::RegionHashing::PrefixSum ? "prefix-sum" : "komihash");
+  printf("  \"runs\": [\n");
+
+  const uint8_t bitDepths[] = {2, 4};
+  for (size_t b = 0; b < sizeof(bitDepths); b++)
+  {
+    const uint8_t bitDepth = bitDepths[b];
+    std::filesystem::remove(captureDir / PUPDMD_INDEX_FILE_NAME, ec);
+
+    PUPDMD::DMD dmd;
+    dmd.SetUseIndexFile(false);
+    dmd.SetRegionHashing(options.regionHashing);
+    auto start = std::chrono::steady_clock::now();
+    dmd.Load(options.dir.c_str(), "bench", bitDepth);
+    const double loadMs = Milliseconds(std::chrono::steady_clock::now() - start);
+
+    // Write the index file once, then measure loading from it. Both have to read the folder themselves instead of
+    // reusing the captures dmd already shares.
+    {
+      PUPDMD::DMD writer;
+      writer.SetShareCaptures(false);
+      writer.Load(options.dir.c_str(), "bench", bitDepth);
+    }
+    if (!std::filesystem::exists(captureDir / PUPDMD_INDEX_FILE_NAME, ec))
+    {
+      fprintf(stderr, "Error writing the index file to %s\n", captureDir.string().c_str());
+      return 1;
+    }
+    PUPDMD::DMD indexed;
+    indexed.SetShareCaptures(false);
+    start = std::chrono::steady_clock::now();
+    indexed.Load(options.dir.c_str(), "bench", bitDepth);
+    const double loadIndexFileMs = Milliseconds(std::chrono::steady_clock::now() - start);
+
+    const PUPDMD::Stats loadStats = dmd.GetStats();
+    printf("    {\n      \"bitDepth\": %d, \"loadMs\": %.3f, \"loadIndexFileMs\": %.3f, \"loadedTriggers\": %zu,\n",
+           bitDepth, loadMs, loadIndexFileMs, dmd.GetTriggers().GetCount());
+    printf("      \"loadPhasesMs\": {\"scan\": %.3f, \"read\": %.3f, \"decode\": %.3f, \"hash\": %.3f, "
+           "\"index\": %.3f},\n",
+           loadStats.loadScanTime / 1e6, loadStats.loadReadTime / 1e6, loadStats.loadDecodeTime / 1e6,
+           loadStats.loadHashTime / 1e6, loadStats.loadIndexTime / 1e6);
+    printf("      \"match\": [\n");
+
+    bool first = true;
+    for (const auto& resolution : s_resolutions)
+    {
+      const Stream stream = GenerateStream(options, captures, resolution, bitDepth, rng);
+      for (PUPDMD::MatchMode mode : {PUPDMD::MatchMode::ExactColor, PUPDMD::MatchMode::Boolean,
+                                     PUPDMD::MatchMode::Indexed})
+      {
+        BenchMatch(&dmd, stream, mode, first);
+        first = false;
+      }
+    }
+
+    printf("\n      ]\n    }%s\n", b + 1 < sizeof(bitDepths) ? "," : "");
+  }
+
+  printf("  ]\n}\n");
+
+  std::filesystem::remove_all(std::filesystem::path(options.dir) / "bench", ec);
+
+  return 0;
+}
@@ -1,16 +1,161 @@
 #include "pupdmd.h"
 
+#include <cstddef>
 #include <cstring>
 #include <filesystem>
 #include <optional>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <regex>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "komihash/komihash.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PUPDMD_SSE2
+#ifdef __AVX2__
+#include <immintrin.h>
+#define PUPDMD_AVX2
+#endif
+#elif defined(__ARM_NEON) || defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define PUPDMD_NEON
+#endif
+
+#if defined(_MSC_VER) && !defined(__SIZEOF_INT128__)
+#include <intrin.h>
+#endif
+
+#ifdef PUPDMD_ALLOCATION_CHECK
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// Debug hook: any heap allocation made by the library while a match is running aborts.
+static thread_local int s_noAllocationScope = 0;
+
+struct NoAllocationScope
+{
+  NoAllocationScope() { s_noAllocationScope++; }
+  ~NoAllocationScope() { s_noAllocationScope--; }
+};
+
+struct AllowAllocationScope
+{
+  AllowAllocationScope() : m_saved(s_noAllocationScope) { s_noAllocationScope = 0; }
+  ~AllowAllocationScope() { s_noAllocationScope = m_saved; }
+  int m_saved;
+};
+
+// Returns nullptr if the allocation fails.
+static void* CheckedAlloc(std::size_t size, std::size_t alignment)
+{
+  // Not an assert, so that the check also works in builds with NDEBUG.
+  if (s_noAllocationScope != 0)
+  {
+    fputs("heap allocation inside PUPDMD::DMD::Match\n", stderr);
+    std::abort();
+  }
+  if (alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__) return std::malloc(size ? size : 1);
+#ifdef _WIN32
+  return _aligned_malloc(size ? size : 1, alignment);
+#else
+  // aligned_alloc() wants a non-zero size that is a multiple of the alignment.
+  return std::aligned_alloc(alignment, (std::max(size, alignment) + alignment - 1) / alignment * alignment);
+#endif
+}
+
+static void CheckedFree(void* p, [[maybe_unused]] std::size_t alignment)
+{
+#ifdef _WIN32
+  if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+  {
+    _aligned_free(p);
+    return;
+  }
+#endif
+  std::free(p);
+}
+
+static void* CheckedNew(std::size_t size, std::size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+{
+  if (void* p = CheckedAlloc(size, alignment)) return p;
+  throw std::bad_alloc();
+}
+
+// Every form of new and delete is replaced, so that all of them allocate and free through the functions above.
+void* operator new(std::size_t size) { return CheckedNew(size); }
+void* operator new[](std::size_t size) { return CheckedNew(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  return CheckedAlloc(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  return CheckedAlloc(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+}
+void* operator new(std::size_t size, std::align_val_t alignment) { return CheckedNew(size, (std::size_t)alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return CheckedNew(size, (std::size_t)alignment); }
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  return CheckedAlloc(size, (std::size_t)alignment);
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  return CheckedAlloc(size, (std::size_t)alignment);
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t alignment) noexcept { CheckedFree(p, (std::size_t)alignment); }
+void operator delete[](void* p, std::align_val_t alignment) noexcept { CheckedFree(p, (std::size_t)alignment); }
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+  CheckedFree(p, (std::size_t)alignment);
+}
+void operator delete[](void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+  CheckedFree(p, (std::size_t)alignment);
+}
+void operator delete(void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  CheckedFree(p, (std::size_t)alignment);
+}
+void operator delete[](void* p, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  CheckedFree(p, (std::size_t)alignment);
+}
+
+#define PUPDMD_NO_ALLOCATIONS() NoAllocationScope noAllocationScope
+#define PUPDMD_ALLOW_ALLOCATIONS() AllowAllocationScope allowAllocationScope
+#else
+#define PUPDMD_NO_ALLOCATIONS()
+#define PUPDMD_ALLOW_ALLOCATIONS()
+#endif
+
 namespace fs = std::filesystem;
 
 namespace PUPDMD
@@ -43,404 +188,3819 @@ std::optional<std::string> find_case_insensitive_folder(const std::string& dir_p
   return std::nullopt;
 }
 
-DMD::DMD() {}
+// Hashes a rectangle straight from the frame rows. The streamed digest is identical to komihash() over a copy
+// of the rectangle.
+static inline uint64_t HashRegion(const uint8_t* pFrame, uint16_t frameWidth, uint8_t bytesPerPixel, uint16_t x,
+                                  uint16_t y, uint16_t width, uint16_t height)
+{
+  komihash_stream_t ctx;
+  komihash_stream_init(&ctx, 0);
+
+  const size_t stride = (size_t)frameWidth * bytesPerPixel;
+  const size_t rowLength = (size_t)width * bytesPerPixel;
+  const uint8_t* pRow = &pFrame[y * stride + x * bytesPerPixel];
+  for (uint16_t row = 0; row < height; row++)
+  {
+    komihash_stream_update(&ctx, pRow, rowLength);
+    pRow += stride;
+  }
 
-DMD::~DMD() {}
+  return komihash_stream_final(&ctx);
+}
 
-void DMD::SetLogCallback(PUPDMD_LogCallback callback, const void* userData)
+// pOut = pIn & pCare. pOut may be pIn.
+static inline void AndBytes(const uint8_t* pIn, const uint8_t* pCare, uint8_t* pOut, size_t size)
 {
-  m_logCallback = callback;
-  m_logUserData = userData;
+  size_t i = 0;
+
+#if defined(PUPDMD_AVX2)
+  for (; i + 32 <= size; i += 32)
+  {
+    const __m256i in = _mm256_loadu_si256((const __m256i*)&pIn[i]);
+    const __m256i care = _mm256_loadu_si256((const __m256i*)&pCare[i]);
+    _mm256_storeu_si256((__m256i*)&pOut[i], _mm256_and_si256(in, care));
+  }
+#endif
+
+#if defined(PUPDMD_SSE2)
+  for (; i + 16 <= size; i += 16)
+  {
+    const __m128i in = _mm_loadu_si128((const __m128i*)&pIn[i]);
+    const __m128i care = _mm_loadu_si128((const __m128i*)&pCare[i]);
+    _mm_storeu_si128((__m128i*)&pOut[i], _mm_and_si128(in, care));
+  }
+#elif defined(PUPDMD_NEON)
+  for (; i + 16 <= size; i += 16)
+  {
+    vst1q_u8(&pOut[i], vandq_u8(vld1q_u8(&pIn[i]), vld1q_u8(&pCare[i])));
+  }
+#endif
+
+  for (; i < size; i++)
+  {
+    pOut[i] = pIn[i] & pCare[i];
+  }
 }
 
-void DMD::Log(const char* format, ...)
+// Like HashRegion(), but every row is ANDed with the next width * bytesPerPixel bytes of pCare first, which are 0xFF
+// for compared and 0x00 for ignored bytes.
+static inline uint64_t HashCareRegion(const uint8_t* pFrame, uint16_t frameWidth, uint8_t bytesPerPixel, uint16_t x,
+                                      uint16_t y, uint16_t width, uint16_t height, const uint8_t* pCare)
 {
-  if (!m_logCallback)
+  uint8_t row[PUPDMD_MAX_WIDTH * 3];
+  komihash_stream_t ctx;
+  komihash_stream_init(&ctx, 0);
+
+  const size_t stride = (size_t)frameWidth * bytesPerPixel;
+  const size_t rowLength = (size_t)width * bytesPerPixel;
+  const uint8_t* pRow = &pFrame[y * stride + x * bytesPerPixel];
+  for (uint16_t r = 0; r < height; r++)
   {
-    return;
+    AndBytes(pRow, pCare, row, rowLength);
+    komihash_stream_update(&ctx, row, rowLength);
+    pRow += stride;
+    pCare += rowLength;
   }
 
-  va_list args;
-  va_start(args, format);
-  (*(m_logCallback))(format, args, m_logUserData);
-  va_end(args);
+  return komihash_stream_final(&ctx);
 }
 
-bool DMD::Load(const char* const puppath, const char* const romname, uint8_t bitDepth)
+// Expands packed care bits (see Hash::careMask) into one 0xFF/0x00 byte per channel for HashCareRegion().
+static void ExpandCareMask(std::span<const uint8_t> careMask, uint32_t pixels, uint8_t bytesPerPixel,
+                           std::vector<uint8_t>* pCare)
 {
-  std::string puppathObj(puppath);
-  if (puppathObj.back() != '\\' && puppathObj.back() != '/')
-    puppathObj += '/';
-  puppathObj += std::string(romname);
-  puppathObj += '/';
+  pCare->resize((size_t)pixels * bytesPerPixel);
+  uint8_t* pOut = pCare->data();
+  for (uint32_t i = 0; i < pixels; i++)
+  {
+    const uint8_t value = ((careMask[i >> 3] >> (i & 7)) & 1) ? 0xFF : 0x00;
+    for (uint8_t c = 0; c < bytesPerPixel; c++) *pOut++ = value;
+  }
+}
 
-  std::optional<std::string> pFolderPath = find_case_insensitive_folder(puppathObj, "PupCapture");
-  if (!pFolderPath) {
-    Log("Directory does not exist: %sPupCapture", puppathObj.c_str());
-    return false;
+#if defined(PUPDMD_SSE2)
+// movemask bits of 16 RGB24 pixels (3 bits each) where a set bit marks a zero channel. Writes 1 for every pixel
+// that has at least one non-zero channel.
+static inline void StoreBoolean16(uint64_t zero, uint8_t* pBoolean)
+{
+  zero &= (zero >> 1) & (zero >> 2);
+  for (int i = 0; i < 16; i++)
+  {
+    pBoolean[i] = !((zero >> (i * 3)) & 1);
   }
+}
+#endif
 
-  Log("Scanning directory: %s", pFolderPath->c_str());
+// Converts a RGB24 frame into one byte per pixel, 1 if the pixel is lit, 0 if it is black.
+static inline void ConvertToBoolean(const uint8_t* pFrame, uint8_t* pBooleanFrame, uint32_t pixels)
+{
+  uint32_t i = 0;
 
-  // Regular expression to extract numeric part from file name (case insensitive)
-  std::regex pattern(R"((\d+)\.bmp)", std::regex_constants::icase);
+#if defined(PUPDMD_AVX2)
+  const __m256i zero256 = _mm256_setzero_si256();
+  for (; i + 32 <= pixels; i += 32)
+  {
+    const uint8_t* p = &pFrame[i * 3];
+    uint64_t m0 = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), zero256));
+    uint64_t m1 =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 32)), zero256));
+    uint64_t m2 =
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + 64)), zero256));
+    StoreBoolean16(m0 | ((m1 & 0xFFFF) << 32), &pBooleanFrame[i]);
+    StoreBoolean16((m1 >> 16) | (m2 << 16), &pBooleanFrame[i + 16]);
+  }
+#endif
 
-  for (const auto& entry : fs::directory_iterator(*pFolderPath))
+#if defined(PUPDMD_SSE2)
+  const __m128i zero128 = _mm_setzero_si128();
+  for (; i + 16 <= pixels; i += 16)
   {
-    std::string filePath = entry.path().string();
-    uint16_t triggerID = 0;
-    std::smatch matches;
-    std::string fileName = fs::path(filePath).filename().string();
+    const uint8_t* p = &pFrame[i * 3];
+    uint64_t m0 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), zero128));
+    uint64_t m1 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), zero128));
+    uint64_t m2 = (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), zero128));
+    StoreBoolean16(m0 | (m1 << 16) | (m2 << 32), &pBooleanFrame[i]);
+  }
+#elif defined(PUPDMD_NEON)
+  const uint8x16_t one = vdupq_n_u8(1);
+  for (; i + 16 <= pixels; i += 16)
+  {
+    uint8x16x3_t rgb = vld3q_u8(&pFrame[i * 3]);
+    uint8x16_t lit = vorrq_u8(vorrq_u8(rgb.val[0], rgb.val[1]), rgb.val[2]);
+    vst1q_u8(&pBooleanFrame[i], vminq_u8(lit, one));
+  }
+#endif
 
-    if (!std::regex_search(fileName, matches, pattern))
+  for (; i < pixels; i++)
+  {
+    pBooleanFrame[i] = !(pFrame[i * 3] == 0 && pFrame[(i * 3) + 1] == 0 && pFrame[(i * 3) + 2] == 0);
+  }
+}
+
+static inline uint16_t RowWords(uint16_t width) { return (width + 63) / 64; }
+
+// Format of the frame passed to a match function.
+struct FrameFormat
+{
+  ColorFormat color = ColorFormat::RGB24;
+  IndexedLayout layout = IndexedLayout::Bytes;
+  const uint8_t* pPalette = nullptr;  // ColorFormat::Palette only
+  uint16_t paletteSize = 0;
+};
+
+static inline uint16_t ToRGB565(const uint8_t* pRGB)
+{
+  return (uint16_t)(((pRGB[0] >> 3) << 11) | ((pRGB[1] >> 2) << 5) | (pRGB[2] >> 3));
+}
+
+// Size of a color frame in bytes.
+static size_t ColorFrameSize(uint16_t width, uint16_t height, ColorFormat color)
+{
+  const size_t pixels = (size_t)width * height;
+  return pixels * (color == ColorFormat::RGB24 ? 3 : (color == ColorFormat::RGB565 ? 2 : 1));
+}
+
+// Copies paletteSize colors of a palette to a table of 256, the missing ones are black.
+static inline void FillPalette(const FrameFormat& format, uint8_t* pPalette)
+{
+  memset(pPalette, 0, 256 * 3);
+  if (format.paletteSize) memcpy(pPalette, format.pPalette, (size_t)format.paletteSize * 3);
+}
+
+// Packs the low planes bits of count bytes into planes bitplanes of RowWords(count) words each. Pixel i goes to bit
+// i % 64 of word i / 64 of every plane.
+static inline void PackBits(const uint8_t* pBytes, uint16_t count, uint8_t planes, uint64_t* pWords)
+{
+  const uint16_t words = RowWords(count);
+  memset(pWords, 0, (size_t)planes * words * sizeof(uint64_t));
+  uint16_t i = 0;
+
+#if defined(PUPDMD_SSE2)
+  // Shifting the 16 bit lanes moves a bit into the sign bit of every byte, bits of the lower byte end below it.
+  for (; i + 16 <= count; i += 16)
+  {
+    const __m128i bytes = _mm_loadu_si128((const __m128i*)&pBytes[i]);
+    for (uint8_t plane = 0; plane < planes; plane++)
     {
-      continue;  // Skip files that don't match the pattern
+      const __m128i shifted = _mm_sll_epi16(bytes, _mm_cvtsi32_si128(7 - plane));
+      pWords[plane * words + i / 64] |= (uint64_t)(uint16_t)_mm_movemask_epi8(shifted) << (i % 64);
     }
-    triggerID = std::stoi(matches[1].str());
-
-    std::ifstream file(filePath, std::ios::binary);
+  }
+#elif defined(PUPDMD_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+  static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t weight = vld1q_u8(weights);
+  for (; i + 16 <= count; i += 16)
+  {
+    const uint8x16_t bytes = vld1q_u8(&pBytes[i]);
+    for (uint8_t plane = 0; plane < planes; plane++)
+    {
+      const uint8x16_t set = vandq_u8(vtstq_u8(bytes, vdupq_n_u8(1 << plane)), weight);
+      const uint64_t bits = vaddv_u8(vget_low_u8(set)) | ((uint64_t)vaddv_u8(vget_high_u8(set)) << 8);
+      pWords[plane * words + i / 64] |= bits << (i % 64);
+    }
+  }
+#endif
 
-    if (!file.is_open())
+  // The bit moves out of the word after its last pixel.
+  for (uint16_t word = i / 64; word < words; word++)
+  {
+    for (uint64_t bit = 1ull << (i % 64); i < count && bit; i++, bit <<= 1)
     {
-      Log("Error opening file: %s", filePath.c_str());
-      continue;
+      for (uint8_t plane = 0; plane < planes; plane++)
+      {
+        if ((pBytes[i] >> plane) & 1) pWords[plane * words + word] |= bit;
+      }
     }
+  }
+}
+
+// Boolean and indexed frames are matched as bitplanes: one plane per row for boolean, four for indexed, every row
+// starting at a word. A 128x32 boolean frame is 64 words.
+static void PackBooleanFrame(const uint8_t* pFrame, uint16_t width, uint16_t height, uint64_t* pPacked)
+{
+  uint8_t row[PUPDMD_MAX_WIDTH];
+  const uint16_t rowWords = RowWords(width);
+  for (uint32_t y = 0; y < height; y++)
+  {
+    ConvertToBoolean(&pFrame[(size_t)y * width * 3], row, width);
+    PackBits(row, width, 1, &pPacked[(size_t)y * rowWords]);
+  }
+}
 
-    // Read BMP header
-    BMPHeader header;
-    file.read(reinterpret_cast<char*>(&header), sizeof(BMPHeader));
+// Boolean planes of a RGB565 or palette frame, a pixel is lit if it is not black.
+static void PackBooleanFrame(const uint8_t* pFrame, uint16_t width, uint16_t height, const FrameFormat& format,
+                             uint64_t* pPacked)
+{
+  if (format.color == ColorFormat::RGB24)
+  {
+    PackBooleanFrame(pFrame, width, height, pPacked);
+    return;
+  }
 
-    // Check if file is a BMP file
-    if (header.signature[0] != 'B' || header.signature[1] != 'M')
+  uint8_t lit[256];
+  if (format.color == ColorFormat::Palette)
+  {
+    uint8_t palette[256 * 3];
+    FillPalette(format, palette);
+    for (int i = 0; i < 256; i++) lit[i] = (palette[i * 3] | palette[i * 3 + 1] | palette[i * 3 + 2]) != 0;
+  }
+
+  uint8_t row[PUPDMD_MAX_WIDTH];
+  const uint16_t rowWords = RowWords(width);
+  for (uint32_t y = 0; y < height; y++)
+  {
+    if (format.color == ColorFormat::RGB565)
     {
-      Log("Not a BMP file: %s", filePath.c_str());
-      continue;
+      const uint16_t* pIn = &((const uint16_t*)pFrame)[(size_t)y * width];
+      for (uint16_t x = 0; x < width; x++) row[x] = pIn[x] != 0;
     }
-
-    if (header.compression != 0)
+    else
     {
-      Log("Compression is not supported: %s", filePath.c_str());
-      continue;
+      const uint8_t* pIn = &pFrame[(size_t)y * width];
+      for (uint16_t x = 0; x < width; x++) row[x] = lit[pIn[x]];
     }
+    PackBits(row, width, 1, &pPacked[(size_t)y * rowWords]);
+  }
+}
+
+static void PackIndexedFrame(const uint8_t* pFrame, uint16_t width, uint16_t height, uint64_t* pPacked)
+{
+  const uint16_t rowWords = RowWords(width);
+  for (uint32_t y = 0; y < height; y++)
+  {
+    PackBits(&pFrame[(size_t)y * width], width, 4, &pPacked[(size_t)y * 4 * rowWords]);
+  }
+}
 
-    // Move file pointer to the beginning of pixel data
-    file.seekg(header.dataOffset, std::ios::beg);
+static inline uint8_t LayoutBits(IndexedLayout layout)
+{
+  return layout == IndexedLayout::Packed2 || layout == IndexedLayout::Planes2 ? 2 : 4;
+}
 
-    // Calculate the size of the pixel data
-    size_t pixelDataSize = header.imageSize == 0 ? header.fileSize - header.dataOffset : header.imageSize;
+static inline bool IsPlanar(IndexedLayout layout)
+{
+  return layout == IndexedLayout::Planes2 || layout == IndexedLayout::Planes4;
+}
 
-    if (pixelDataSize == header.width * header.height * 3 &&
-        ((header.width == 128 && header.height == 16) || (header.width == 128 && header.height == 32) ||
-         (header.width == 192 && header.height == 64)))
-    {
-      PUPDMD::Hash hash;
-      std::vector<uint8_t> pixelData(pixelDataSize);
-      std::vector<uint8_t> rgb;
-      std::vector<uint8_t> indexed;
-      rgb.reserve(pixelDataSize);
-      indexed.reserve(pixelDataSize / 3);
+static size_t IndexedFrameSize(uint16_t width, uint16_t height, IndexedLayout layout)
+{
+  const size_t pixels = (size_t)width * height;
+  return layout == IndexedLayout::Bytes ? pixels : pixels * LayoutBits(layout) / 8;
+}
 
-      file.read(reinterpret_cast<char*>(pixelData.data()), pixelDataSize);
+// Gathers bits 0, 2, 4, ... of value into the low 32 bits.
+static inline uint64_t CompactBits2(uint64_t value)
+{
+  value &= 0x5555555555555555ull;
+  value = (value | (value >> 1)) & 0x3333333333333333ull;
+  value = (value | (value >> 2)) & 0x0f0f0f0f0f0f0f0full;
+  value = (value | (value >> 4)) & 0x00ff00ff00ff00ffull;
+  value = (value | (value >> 8)) & 0x0000ffff0000ffffull;
+  return (value | (value >> 16)) & 0x00000000ffffffffull;
+}
 
-      for (uint8_t y = 0; y < header.height; y++)
-      {
-        for (uint8_t x = 0; x < header.width; x++)
-        {
-          // Usually the order is BGR in BMP
-          // BMP starts at the lower left, pinball frames at upper left
-          uint8_t b = pixelData.at(((header.height - 1 - y) * header.width + x) * 3);
-          uint8_t g = pixelData.at(((header.height - 1 - y) * header.width + x) * 3 + 1);
-          uint8_t r = pixelData.at(((header.height - 1 - y) * header.width + x) * 3 + 2);
-          rgb.push_back(r);
-          rgb.push_back(g);
-          rgb.push_back(b);
-
-          // Since PupCapture DMDs are orange it is sufficient to look at red
-          switch (bitDepth)
-          {
-            case 2:
-              if (r == PUPDMD_MASK_R)
-                indexed.push_back(0);
-              else if (r < 8)
-                indexed.push_back(0);
-              else if (r < 48)
-                indexed.push_back(1);
-              else if (r < 128)
-                indexed.push_back(2);
-              else
-                indexed.push_back(3);
-              break;
-            case 4:
-              if (r == PUPDMD_MASK_R)
-                indexed.push_back(0);
-              else if (r < 8)
-                indexed.push_back(0);
-              else if (r < 24)
-                indexed.push_back(1);
-              else if (r < 48)
-                indexed.push_back(2);
-              else if (r < 56)
-                indexed.push_back(3);
-              else if (r < 72)
-                indexed.push_back(4);
-              else if (r < 96)
-                indexed.push_back(5);
-              else if (r < 112)
-                indexed.push_back(6);
-              else if (r < 128)
-                indexed.push_back(7);
-              else if (r < 144)
-                indexed.push_back(8);
-              else if (r < 160)
-                indexed.push_back(9);
-              else if (r < 176)
-                indexed.push_back(10);
-              else if (r < 192)
-                indexed.push_back(11);
-              else if (r < 208)
-                indexed.push_back(12);
-              else if (r < 224)
-                indexed.push_back(13);
-              else if (r < 240)
-                indexed.push_back(14);
-              else
-                indexed.push_back(15);
-              break;
-          }
+// Gathers bits 0, 4, 8, ... of value into the low 16 bits.
+static inline uint64_t CompactBits4(uint64_t value)
+{
+  value &= 0x1111111111111111ull;
+  value = (value | (value >> 3)) & 0x0303030303030303ull;
+  value = (value | (value >> 6)) & 0x000f000f000f000full;
+  value = (value | (value >> 12)) & 0x000000ff000000ffull;
+  return (value | (value >> 24)) & 0x000000000000ffffull;
+}
 
-          // if (r > 0)
-          //   Log("Found illuminated pixel RGB %03d %03d %03d, converted to index %02d", r, g, b, indexed.back());
+// Packs an indexed frame of a packed layout into the planes of PackIndexedFrame() without unpacking it: a word of
+// Packed2 holds 32 pixels, one of Packed4 16, whose bits are gathered per plane, and the rows of the Planes layouts
+// are copied as they are.
+static void PackIndexedFrame(const uint8_t* pFrame, uint16_t width, uint16_t height, IndexedLayout layout,
+                             uint64_t* pPacked)
+{
+  if (layout == IndexedLayout::Bytes)
+  {
+    PackIndexedFrame(pFrame, width, height, pPacked);
+    return;
+  }
 
-          if (PUPDMD_MASK_R == r && PUPDMD_MASK_G == g && PUPDMD_MASK_B == b)
-          {
-            if (hash.maskX == 255)
-            {
-              // Found left top corner of a mask
-              hash.maskX = x;
-              hash.maskY = y;
-            }
-            else if (hash.maskX < 192)
-            {
-              if (y == hash.maskY)
-                hash.maskWidth++;
-              else if (x == hash.maskX)
-                hash.maskHeight++;
-            }
-          }
-        }
-      }
+  const uint16_t rowWords = RowWords(width);
+  const uint8_t bits = LayoutBits(layout);
+  const size_t rowBytes = (size_t)width * bits / 8;
+  const size_t planeSize = (size_t)width * height / 8;
+  memset(pPacked, 0, (size_t)rowWords * 4 * height * sizeof(uint64_t));
 
-      if (hash.maskX < 192)
+  for (uint32_t y = 0; y < height; y++)
+  {
+    uint64_t* pRow = &pPacked[(size_t)y * 4 * rowWords];
+    if (IsPlanar(layout))
+    {
+      for (uint8_t plane = 0; plane < bits; plane++)
       {
-        hash.mask = true;
-        hash.maskX++;
-        hash.maskY++;
-        hash.maskWidth--;
-        hash.maskHeight--;
+        memcpy(&pRow[plane * rowWords], &pFrame[(plane * planeSize) + ((size_t)y * width / 8)], width / 8);
       }
-      else
+      continue;
+    }
+
+    const uint8_t* pIn = &pFrame[y * rowBytes];
+    for (size_t i = 0; i < rowBytes; i += 8)
+    {
+      uint64_t value = 0;
+      memcpy(&value, &pIn[i], std::min<size_t>(8, rowBytes - i));
+      const size_t x = i * 8 / bits;
+      for (uint8_t plane = 0; plane < bits; plane++)
       {
-        hash.mask = false;
-        hash.maskX = 0;
-        hash.maskY = 0;
-        hash.maskWidth = header.width;
-        hash.maskHeight = header.height;
+        const uint64_t planeBits = bits == 2 ? CompactBits2(value >> plane) : CompactBits4(value >> plane);
+        pRow[(plane * rowWords) + (x / 64)] |= planeBits << (x % 64);
       }
-      hash.width = header.width;
-      hash.height = header.height;
-
-      CalculateHash(rgb.data(), &hash, true);
-      CalculateHash(rgb.data(), &hash, false);
-      CalculateHashIndexed(indexed.data(), &hash);
-
-      m_HashMap[triggerID] = hash;
-      Log("Added PUP DMD %dx%d trigger ID: %03d, mask: %d, x: %03d, y: %03d, width: %03d, height: %03d, "
-          "exactColorHash: %020" PRIu64 ", booleanHash: %020" PRIu64 ", indexedHash: %020" PRIu64,
-          hash.width, hash.height, triggerID, hash.mask, hash.maskX, hash.maskY, hash.maskWidth, hash.maskHeight,
-          hash.exactColorHash, hash.booleanHash, hash.indexedHash);
     }
-
-    file.close();
   }
-
-  return true;
 }
 
-void DMD::CalculateHash(const uint8_t* pFrame, Hash* pHash, bool exactColor)
+// One index per byte from a packed layout, only used for recordings.
+static void UnpackIndexedFrame(const uint8_t* pFrame, uint16_t width, uint16_t height, IndexedLayout layout,
+                               uint8_t* pOut)
 {
-  uint16_t pixels = pHash->width * pHash->height;
-  if (exactColor)
+  const size_t pixels = (size_t)width * height;
+  const uint8_t bits = LayoutBits(layout);
+  for (size_t i = 0; i < pixels; i++)
   {
-    if (pHash->mask)
+    uint8_t value = 0;
+    if (IsPlanar(layout))
     {
-      uint16_t width = (uint16_t)pHash->maskWidth * 3;
-      uint8_t height = pHash->maskY + pHash->maskHeight;
-      uint16_t length = width * pHash->maskHeight;
-      uint8_t* pBuffer = (uint8_t*)malloc(length);
-      uint16_t idx = 0;
-      for (uint8_t y = pHash->maskY; y < height; y++)
+      for (uint8_t plane = 0; plane < bits; plane++)
       {
-        memcpy(&pBuffer[idx], &pFrame[((y * pHash->width) + pHash->maskX) * 3], width);
-        idx += width;
+        value |= ((pFrame[(plane * pixels / 8) + (i / 8)] >> (i % 8)) & 1) << plane;
       }
-      pHash->exactColorHash = komihash(pBuffer, length, 0);
-      free(pBuffer);
     }
     else
     {
-      pHash->exactColorHash = komihash(pFrame, pixels * 3, 0);
+      value = (pFrame[i * bits / 8] >> (i * bits % 8)) & ((1 << bits) - 1);
     }
+    pOut[i] = value;
+  }
+}
+
+// Copies bits [x, x + width) of a packed row of rowWords words to pOut and clears the bits past width.
+static inline void ExtractBits(const uint64_t* pRow, uint16_t rowWords, uint16_t x, uint16_t width, uint64_t* pOut)
+{
+  const uint16_t words = RowWords(width);
+  const uint16_t first = x / 64;
+  const uint8_t shift = x % 64;
+  if (!shift)
+  {
+    memcpy(pOut, &pRow[first], words * sizeof(uint64_t));
   }
   else
   {
-    uint8_t* pBooleanFrame = (uint8_t*)malloc(pixels);
-    for (uint16_t i = 0; i < pixels; i++)
+    for (uint16_t i = 0; i < words; i++)
     {
-      pBooleanFrame[i] = !(pFrame[i * 3] == 0 && pFrame[(i * 3) + 1] == 0 && pFrame[(i * 3) + 2] == 0);
+      uint64_t value = pRow[first + i] >> shift;
+      if (first + i + 1 < rowWords) value |= pRow[first + i + 1] << (64 - shift);
+      pOut[i] = value;
     }
+  }
+  if (width % 64) pOut[words - 1] &= (1ull << (width % 64)) - 1;
+}
 
-    if (pHash->mask)
-    {
-      uint8_t height = pHash->maskY + pHash->maskHeight;
-      uint16_t length = pHash->maskWidth * pHash->maskHeight;
-      uint8_t* pBuffer = (uint8_t*)malloc(length);
-      uint16_t idx = 0;
-      for (uint8_t y = pHash->maskY; y < height; y++)
-      {
-        memcpy(&pBuffer[idx], &pBooleanFrame[(y * pHash->width) + pHash->maskX], pHash->maskWidth);
-        idx += pHash->maskWidth;
-      }
-      pHash->booleanHash = komihash(pBuffer, length, 0);
-      free(pBuffer);
-    }
-    else
+// Row y of the mask box x, y, width of a packed frame in the layout of Hash::booleanBits, ANDed with the care bits of
+// that row if pCare is not nullptr.
+static inline void ExtractRegionRow(const uint64_t* pPacked, uint16_t frameWidth, uint8_t planes, uint16_t x,
+                                    uint16_t y, uint16_t width, const uint64_t* pCare, uint64_t* pOut)
+{
+  const uint16_t frameRowWords = RowWords(frameWidth);
+  const uint16_t rowWords = RowWords(width);
+  const uint64_t* pRow = &pPacked[(size_t)y * planes * frameRowWords];
+  for (uint8_t plane = 0; plane < planes; plane++, pRow += frameRowWords, pOut += rowWords)
+  {
+    ExtractBits(pRow, frameRowWords, x, width, pOut);
+    if (pCare)
     {
-      pHash->booleanHash = komihash(pBooleanFrame, pixels, 0);
+      for (uint16_t i = 0; i < rowWords; i++) pOut[i] &= pCare[i];
     }
-    free(pBooleanFrame);
   }
 }
 
-void DMD::CalculateHashIndexed(const uint8_t* pFrame, Hash* pHash)
+// Boolean and indexed region hash over a packed frame. The digest equals komihash() over Hash::booleanBits or
+// Hash::indexedBits of a capture of the same region.
+static inline uint64_t HashPackedRegion(const uint64_t* pPacked, uint16_t frameWidth, uint8_t planes, uint16_t x,
+                                        uint16_t y, uint16_t width, uint16_t height, const uint64_t* pCare)
 {
-  if (pHash->mask)
+  const uint16_t rowWords = RowWords(width);
+  const size_t rowSize = (size_t)planes * rowWords * sizeof(uint64_t);
+  // Full width rows are already laid out like the capture.
+  if (x == 0 && width == frameWidth && !pCare)
   {
-    uint8_t height = pHash->maskY + pHash->maskHeight;
-    uint16_t length = pHash->maskWidth * pHash->maskHeight;
-    uint8_t* pBuffer = (uint8_t*)malloc(length);
-    uint16_t idx = 0;
-
-    for (uint8_t y = pHash->maskY; y < height; y++)
-    {
-      memcpy(&pBuffer[idx], &pFrame[(y * pHash->width) + pHash->maskX], pHash->maskWidth);
-      idx += pHash->maskWidth;
-    }
-    pHash->indexedHash = komihash(pBuffer, length, 0);
-    free(pBuffer);
+    return komihash(&pPacked[(size_t)y * planes * rowWords], rowSize * height, 0);
   }
-  else
+
+  uint64_t row[PUPDMD_MAX_WIDTH / 64 * 4];
+  komihash_stream_t ctx;
+  komihash_stream_init(&ctx, 0);
+  for (uint16_t r = 0; r < height; r++)
   {
-    pHash->indexedHash = komihash(pFrame, 128 * 32, 0);
+    ExtractRegionRow(pPacked, frameWidth, planes, x, y + r, width, pCare ? &pCare[(size_t)r * rowWords] : nullptr,
+                     row);
+    komihash_stream_update(&ctx, row, rowSize);
   }
+
+  return komihash_stream_final(&ctx);
 }
 
-uint16_t DMD::Match(const uint8_t* pFrame, uint8_t width, uint8_t height, bool exactColor)
+// Care mask of a mask box as words, one bit per pixel and rows starting at a word like Hash::booleanBits.
+static void PackCareMask(const Hash& hash, std::vector<uint64_t>* pCare)
 {
-  uint64_t fullHash = 0;
-  Hash hash;
-  hash.width = width;
-  hash.height = height;
-
-  for (const auto& pair : m_HashMap)
+  const uint16_t rowWords = RowWords(hash.maskWidth);
+  pCare->assign((size_t)rowWords * hash.maskHeight, 0);
+  for (uint32_t y = 0; y < hash.maskHeight; y++)
   {
-    if (pair.second.width != width || pair.second.height != height) continue;
-
-    hash.mask = pair.second.mask;
-    if (hash.mask)
-    {
-      hash.maskX = pair.second.maskX;
-      hash.maskY = pair.second.maskY;
-      hash.maskWidth = pair.second.maskWidth;
-      hash.maskHeight = pair.second.maskHeight;
-      CalculateHash(pFrame, &hash, exactColor);
-    }
-    else
+    for (uint32_t x = 0; x < hash.maskWidth; x++)
     {
-      if (fullHash)
-      {
-        hash.exactColorHash = hash.booleanHash = fullHash;
-      }
-      else
+      const size_t i = (size_t)y * hash.maskWidth + x;
+      if (hash.careMask.empty() || ((hash.careMask[i >> 3] >> (i & 7)) & 1))
       {
-        CalculateHash(pFrame, &hash, exactColor);
-        fullHash = exactColor ? hash.exactColorHash : hash.booleanHash;
+        (*pCare)[(size_t)y * rowWords + x / 64] |= 1ull << (x % 64);
       }
     }
+  }
+}
 
-    if ((exactColor && hash.exactColorHash == pair.second.exactColorHash) ||
-        (!exactColor && hash.booleanHash == pair.second.booleanHash))
+// Packs the mask box of a one byte per pixel plane into planes bitplanes per row, see Hash::booleanBits.
+static void PackRegion(const uint8_t* pPlane, const Hash& hash, uint8_t planes, const std::vector<uint64_t>& care,
+                       std::vector<uint64_t>* pBits)
+{
+  const uint16_t rowWords = RowWords(hash.maskWidth);
+  pBits->resize((size_t)rowWords * planes * hash.maskHeight);
+  uint64_t* pOut = pBits->data();
+  for (uint32_t y = 0; y < hash.maskHeight; y++)
+  {
+    PackBits(&pPlane[((size_t)(hash.maskY + y) * hash.width) + hash.maskX], hash.maskWidth, planes, pOut);
+    for (uint8_t plane = 0; plane < planes; plane++, pOut += rowWords)
     {
-      if (pair.first != m_lastTriggerID)
-      {
-        m_lastTriggerID = pair.first;
-        Log("Matched PUP DMD trigger ID: %d", pair.first);
-        return pair.first;
-      }
-
-      return 0;
+      for (uint16_t i = 0; i < rowWords; i++) pOut[i] &= care[(size_t)y * rowWords + i];
     }
   }
+}
+
+// 2D polynomial hashes modulo the Mersenne prime 2^61 - 1, see RegionHashing::PrefixSum. A rectangle hashes to the
+// sum of value(x, y) * X^x * Y^y over its pixels, x and y counted from its top left corner.
+static constexpr uint64_t s_prefixModulus = (1ull << 61) - 1;
+static constexpr uint64_t s_prefixBaseX = 0x0B4F3A2D6C8E1F57;
+static constexpr uint64_t s_prefixBaseY = 0x1C6E2B9A7D3F4851;
 
-  return 0;
+// Reduces any 64 bit value modulo s_prefixModulus.
+static inline uint64_t ReduceMod61(uint64_t value)
+{
+  value = (value & s_prefixModulus) + (value >> 61);
+  return value >= s_prefixModulus ? value - s_prefixModulus : value;
 }
 
-uint16_t DMD::MatchIndexed(const uint8_t* pFrame, uint8_t width, uint8_t height)
+static inline uint64_t AddMod61(uint64_t a, uint64_t b) { return ReduceMod61(a + b); }
+
+// Unreduced 128 bit sum of products, so long rows need no reduction per pixel. The high word must stay below 2^61.
+struct Sum128
 {
-  uint64_t fullHash = 0;
-  Hash hash;
-  hash.width = width;
-  hash.height = height;
+  uint64_t low = 0;
+  uint64_t high = 0;
 
-  for (const auto& pair : m_HashMap)
+  void Add(uint64_t value)
   {
-    if (pair.second.width != width || pair.second.height != height) continue;
-
-    hash.mask = pair.second.mask;
-    if (hash.mask)
-    {
-      hash.maskX = pair.second.maskX;
-      hash.maskY = pair.second.maskY;
-      hash.maskWidth = pair.second.maskWidth;
-      hash.maskHeight = pair.second.maskHeight;
-      CalculateHashIndexed(pFrame, &hash);
-    }
-    else
-    {
-      if (fullHash)
-      {
-        hash.indexedHash = fullHash;
-      }
-      else
-      {
-        CalculateHashIndexed(pFrame, &hash);
-        fullHash = hash.indexedHash;
-      }
-    }
+    low += value;
+    high += low < value;
+  }
 
-    if (hash.indexedHash == pair.second.indexedHash)
-    {
-      if (pair.first != m_lastTriggerID)
-      {
-        m_lastTriggerID = pair.first;
-        Log("Matched PUP DMD trigger ID: %d", pair.first);
-        return pair.first;
-      }
+  void MulAdd(uint64_t a, uint64_t b)
+  {
+#if defined(__SIZEOF_INT128__)
+    const unsigned __int128 product = (unsigned __int128)a * b;
+    const uint64_t productLow = (uint64_t)product;
+    const uint64_t productHigh = (uint64_t)(product >> 64);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    const uint64_t productLow = a * b;
+    const uint64_t productHigh = __umulh(a, b);
+#else
+    const uint64_t ll = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    const uint64_t lh = (a & 0xFFFFFFFF) * (b >> 32);
+    const uint64_t hl = (a >> 32) * (b & 0xFFFFFFFF);
+    const uint64_t middle = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+    const uint64_t productLow = (middle << 32) | (ll & 0xFFFFFFFF);
+    const uint64_t productHigh = (a >> 32) * (b >> 32) + (lh >> 32) + (hl >> 32) + (middle >> 32);
+#endif
+    Add(productLow);
+    high += productHigh;
+  }
 
-      return 0;
-    }
+  void Add(const Sum128& other)
+  {
+    Add(other.low);
+    high += other.high;
   }
 
-  return 0;
+  bool IsZero() const { return !(low | high); }
+
+  // 2^61 = 1, so the bits above 61 are simply added to the ones below.
+  uint64_t Reduce() const { return ReduceMod61((low & s_prefixModulus) + (low >> 61) + (high << 3)); }
+};
+
+// a * b modulo s_prefixModulus, both below it.
+static inline uint64_t MulMod61(uint64_t a, uint64_t b)
+{
+  Sum128 product;
+  product.MulAdd(a, b);
+
+  return product.Reduce();
+}
+
+static uint64_t PowMod61(uint64_t base, uint64_t exponent)
+{
+  uint64_t result = 1;
+  for (; exponent; exponent >>= 1, base = MulMod61(base, base))
+  {
+    if (exponent & 1) result = MulMod61(result, base);
+  }
+
+  return result;
+}
+
+// X^x and Y^y for every column and row of a frame.
+struct PrefixPowers
+{
+  uint64_t x[PUPDMD_MAX_WIDTH + 1];
+  uint64_t y[PUPDMD_MAX_HEIGHT + 1];
+};
+
+static const PrefixPowers& GetPrefixPowers()
+{
+  static const PrefixPowers s_powers = []
+  {
+    PrefixPowers powers;
+    powers.x[0] = powers.y[0] = 1;
+    for (int i = 1; i <= PUPDMD_MAX_WIDTH; i++) powers.x[i] = MulMod61(powers.x[i - 1], s_prefixBaseX);
+    for (int i = 1; i <= PUPDMD_MAX_HEIGHT; i++) powers.y[i] = MulMod61(powers.y[i - 1], s_prefixBaseY);
+    return powers;
+  }();
+
+  return s_powers;
+}
+
+// Pixel of bitplanes laid out like Hash::booleanBits, the bit of plane p is bit p of the value.
+static inline uint64_t PlanesValue(const uint64_t* pRow, uint8_t planes, uint16_t rowWords, uint16_t x)
+{
+  uint64_t value = 0;
+  for (uint8_t plane = 0; plane < planes; plane++)
+  {
+    value |= ((pRow[plane * rowWords + x / 64] >> (x % 64)) & 1) << plane;
+  }
+
+  return value;
+}
+
+// 2D polynomial hash of a width x height rectangle, value(x, y) returns its pixels below s_prefixModulus.
+template <typename Value>
+static uint64_t CalculatePrefixHash(uint16_t width, uint16_t height, Value value)
+{
+  const PrefixPowers& powers = GetPrefixPowers();
+  uint64_t hash = 0;
+  for (uint16_t y = 0; y < height; y++)
+  {
+    uint64_t row = 0;
+    for (uint16_t x = 0; x < width; x++) row = AddMod61(row, MulMod61(value(x, y), powers.x[x]));
+    hash = AddMod61(hash, MulMod61(row, powers.y[y]));
+  }
+
+  return hash;
+}
+
+// Exact color hash of a capture of bytesPerPixel bytes per pixel.
+static uint64_t CalculateColorHash(const uint8_t* pFrame, uint8_t bytesPerPixel, const Hash& hash)
+{
+  if (!hash.careMask.empty())
+  {
+    std::vector<uint8_t> care;
+    ExpandCareMask(hash.careMask, (uint32_t)hash.maskWidth * hash.maskHeight, bytesPerPixel, &care);
+    return HashCareRegion(pFrame, hash.width, bytesPerPixel, hash.maskX, hash.maskY, hash.maskWidth, hash.maskHeight,
+                          care.data());
+  }
+  if (hash.mask)
+  {
+    return HashRegion(pFrame, hash.width, bytesPerPixel, hash.maskX, hash.maskY, hash.maskWidth, hash.maskHeight);
+  }
+
+  return komihash(pFrame, (size_t)hash.width * hash.height * bytesPerPixel, 0);
+}
+
+// Exact color hashes of a RGB24 capture, as it is and converted to RGB565, with komihash and as prefix hashes.
+static void CalculateHash(const uint8_t* pFrame, Hash* pHash)
+{
+  const size_t pixels = (size_t)pHash->width * pHash->height;
+  std::vector<uint16_t> rgb565(pixels);
+  for (size_t i = 0; i < pixels; i++) rgb565[i] = ToRGB565(&pFrame[i * 3]);
+
+  pHash->exactColorHash = CalculateColorHash(pFrame, 3, *pHash);
+  pHash->rgb565Hash = CalculateColorHash((const uint8_t*)rgb565.data(), 2, *pHash);
+
+  const Hash& hash = *pHash;
+  pHash->exactColorPrefixHash = CalculatePrefixHash(
+      hash.maskWidth, hash.maskHeight,
+      [&](uint16_t x, uint16_t y)
+      {
+        const uint8_t* pPixel = &pFrame[(((size_t)(hash.maskY + y) * hash.width) + hash.maskX + x) * 3];
+        return ((uint64_t)pPixel[0] << 16) | (pPixel[1] << 8) | pPixel[2];
+      });
+  pHash->rgb565PrefixHash =
+      CalculatePrefixHash(hash.maskWidth, hash.maskHeight, [&](uint16_t x, uint16_t y)
+                          { return (uint64_t)rgb565[((size_t)(hash.maskY + y) * hash.width) + hash.maskX + x]; });
+}
+
+static inline std::span<const uint64_t> GetBoolean565Bits(const Hash& hash)
+{
+  return hash.boolean565Bits.empty() ? hash.booleanBits : hash.boolean565Bits;
+}
+
+// Boolean and indexed hashes of a capture, over the bits packed by PackRegion(), with komihash and as prefix hashes.
+static void CalculateHashPacked(Hash* pHash)
+{
+  const std::span<const uint64_t> boolean565Bits = GetBoolean565Bits(*pHash);
+  pHash->booleanHash = komihash(pHash->booleanBits.data(), pHash->booleanBits.size() * sizeof(uint64_t), 0);
+  pHash->indexedHash = komihash(pHash->indexedBits.data(), pHash->indexedBits.size() * sizeof(uint64_t), 0);
+  pHash->boolean565Hash = komihash(boolean565Bits.data(), boolean565Bits.size() * sizeof(uint64_t), 0);
+
+  const uint16_t rowWords = RowWords(pHash->maskWidth);
+  const uint64_t* pBoolean = pHash->booleanBits.data();
+  const uint64_t* pIndexed = pHash->indexedBits.data();
+  const uint64_t* pBoolean565 = boolean565Bits.data();
+  pHash->booleanPrefixHash =
+      CalculatePrefixHash(pHash->maskWidth, pHash->maskHeight, [&](uint16_t x, uint16_t y)
+                          { return PlanesValue(&pBoolean[(size_t)y * rowWords], 1, rowWords, x); });
+  pHash->boolean565PrefixHash =
+      CalculatePrefixHash(pHash->maskWidth, pHash->maskHeight, [&](uint16_t x, uint16_t y)
+                          { return PlanesValue(&pBoolean565[(size_t)y * rowWords], 1, rowWords, x); });
+  pHash->indexedPrefixHash =
+      CalculatePrefixHash(pHash->maskWidth, pHash->maskHeight, [&](uint16_t x, uint16_t y)
+                          { return PlanesValue(&pIndexed[(size_t)y * 4 * rowWords], 4, rowWords, x); });
+}
+
+// Triggers sharing the same mask rectangle and care mask, so each region is hashed only once per frame. The hashes
+// of a region are a sorted slice [first, first + count) of TriggerTable::hashes for every column.
+struct MaskRegion
+{
+  bool mask = true;
+  uint16_t maskX = 0;
+  uint16_t maskY = 0;
+  uint16_t maskWidth = 0;
+  uint16_t maskHeight = 0;
+  int32_t careMask = -1;  // index into TriggerTable::careMasks, -1 compares the whole rectangle
+  int32_t fuzzy = -1;     // index into TriggerTable::fuzzyRegions, -1 without a tolerance
+  // 1 / (X^maskX * Y^maskY) for RegionHashing::PrefixSum, 0 if the region is hashed with komihash.
+  uint64_t prefixScale = 0;
+  // Columns and rows of the mask box edges in the prefix sums of the resolution.
+  uint16_t prefixLeft = 0;
+  uint16_t prefixRight = 0;
+  uint16_t prefixTop = 0;
+  uint16_t prefixBottom = 0;
+  uint32_t first[5] = {0, 0, 0, 0, 0};
+  uint32_t count[5] = {0, 0, 0, 0, 0};
+};
+
+// Columns of TriggerTable::hashes holding Hash::rgb565Hash and Hash::boolean565Hash, after the ones of the three match
+// modes.
+static constexpr int s_rgb565Column = 3;
+static constexpr int s_boolean565Column = 4;
+
+// Work done by one FindTrigger()/FindTriggers() call, added to the DMD counters by the caller.
+struct ScanCounts
+{
+  uint32_t hashes[3] = {0, 0, 0};
+  uint32_t reused = 0;
+  uint32_t triggers = 0;
+  uint32_t tolerant = 0;
+};
+
+struct TriggerTable;
+struct Resolution;
+
+typedef bool (*FindTriggerKernel)(const TriggerTable& table, const Resolution& resolution, const uint8_t* pFrame,
+                                  uint64_t* pPackedFrame, uint64_t* pPrefixSums, const uint16_t* pDirtyRows,
+                                  uint64_t* pRegionHashes, uint16_t* pTriggerID, ScanCounts* pCounts);
+
+// The regions of one resolution are stored next to each other.
+struct Resolution
+{
+  uint16_t width = 0;
+  uint16_t height = 0;
+  uint16_t firstRegion = 0;
+  uint16_t regionCount = 0;
+  // Indexed by MatchMode, chosen by SelectKernels() when the table is built.
+  FindTriggerKernel findTrigger[3] = {nullptr, nullptr, nullptr};
+  // Sorted mask box edges of the regions with a MaskRegion::prefixScale in TriggerTable::prefixEdges, the columns
+  // followed by the rows. Prefix sums are only kept at them.
+  uint32_t firstPrefixEdge = 0;
+  uint16_t prefixColumns = 0;
+  uint16_t prefixRows = 0;
+  // X^x * Y^y of every pixel in TriggerTable::prefixWeights, row by row.
+  uint32_t firstPrefixWeight = 0;
+};
+
+// Care mask of a region: rgb and rgb565 are expanded for HashCareRegion(), 3 and 2 bytes per pixel of the mask box,
+// bits is packed for the boolean and indexed planes, see PackCareMask().
+struct CareMask
+{
+  std::vector<uint8_t> rgb;
+  std::vector<uint8_t> rgb565;
+  std::vector<uint64_t> bits;
+};
+
+// Packed captures of a region for tolerant matching, [0] is boolean, [1] indexed mode and [2] boolean mode of RGB565
+// frames. If the region has at least
+// tolerance + 1 rows, they are split into that many bands: a capture within the tolerance matches at least one band
+// exactly, so only the captures sharing a band hash with the frame are compared bit by bit. Otherwise all are.
+struct FuzzyRegion
+{
+  uint16_t rowWords = 0;
+  uint16_t bands = 0;
+  uint32_t first[3] = {0, 0, 0};  // slice of TriggerTable::fuzzyTriggers
+  uint32_t count[3] = {0, 0, 0};
+  uint32_t keyFirst[3] = {0, 0, 0};  // sorted slice of TriggerTable::bandKeys
+  uint32_t keyCount[3] = {0, 0, 0};
+};
+
+struct FuzzyTrigger
+{
+  uint16_t triggerID = 0;
+  const uint64_t* pBits = nullptr;  // Hash::booleanBits, indexedBits or boolean565Bits of TriggerTable::entries
+};
+
+// Capture decoded from a BMP by LoadCapture(). The spans of hash point into the vectors, which keep their buffers when
+// the capture is moved.
+struct LoadedCapture
+{
+  Hash hash;
+  std::vector<uint8_t> careMask;
+  std::vector<uint64_t> booleanBits;
+  std::vector<uint64_t> indexedBits;
+  std::vector<uint64_t> boolean565Bits;
+};
+
+// Capture together with the memory its spans point into, its LoadedCapture or the mapped index file.
+struct StoredCapture
+{
+  Hash hash;
+  std::shared_ptr<const void> storage;
+};
+
+// Triggers of one PupCapture folder as read by Load(), before AddCaptureSet() shares them.
+struct CaptureData
+{
+  std::string folder;
+  std::string files;
+  std::map<uint16_t, StoredCapture> triggers;
+};
+
+// Triggers of one PupCapture folder ordered by ID, see DMD::SetShareCaptures(). Immutable once built, identical
+// captures of different folders share one Hash. Each Hash keeps its StoredCapture alive.
+struct CaptureSet
+{
+  std::string folder;  // the rom folder passed to Load()
+  std::string files;   // name, size and last write time of every capture, see Load()
+  std::vector<std::pair<uint16_t, std::shared_ptr<const Hash>>> triggers;
+};
+
+// Immutable set of triggers. Load() builds a new table and publishes it, sessions only ever read it. DMDs that loaded
+// the same folders with the same tolerance share one table.
+struct TriggerTable
+{
+  uint64_t generation = 0;
+  // Capture sets merged into this table in load order. They own the captures entries points to.
+  std::vector<std::shared_ptr<const CaptureSet>> sources;
+  // All triggers ordered by ID, exposed through TriggerView.
+  std::vector<uint16_t> ids;
+  std::vector<const Hash*> entries;
+  std::vector<Resolution> resolutions;
+  std::vector<MaskRegion> regions;
+  std::vector<CareMask> careMasks;
+  uint16_t tolerance = 0;
+  RegionHashing hashing = RegionHashing::Komihash;
+  std::vector<FuzzyRegion> fuzzyRegions;
+  std::vector<FuzzyTrigger> fuzzyTriggers[3];
+  // Band hash and index into fuzzyTriggers.
+  std::vector<std::pair<uint64_t, uint32_t>> bandKeys[3];
+  // Indexed by MatchMode, then s_rgb565Column and s_boolean565Column. Every hash appears once per region, together
+  // with the lowest trigger ID that has it.
+  std::vector<uint64_t> hashes[5];
+  std::vector<uint16_t> triggerIDs[5];
+  std::vector<uint16_t> prefixEdges;
+  std::vector<uint64_t> prefixWeights;
+};
+
+static const Resolution* FindResolution(const TriggerTable& table, uint16_t width, uint16_t height)
+{
+  for (const auto& resolution : table.resolutions)
+  {
+    if (resolution.width == width && resolution.height == height) return &resolution;
+  }
+
+  return nullptr;
+}
+
+static bool FindHash(const TriggerTable& table, const MaskRegion& region, int mode, uint64_t hash,
+                     uint16_t* pTriggerID)
+{
+  const uint64_t* pBegin = table.hashes[mode].data() + region.first[mode];
+  const uint64_t* pEnd = pBegin + region.count[mode];
+  const uint64_t* pHash = std::lower_bound(pBegin, pEnd, hash);
+  if (pHash == pEnd || *pHash != hash) return false;
+
+  *pTriggerID = table.triggerIDs[mode][pHash - table.hashes[mode].data()];
+  return true;
+}
+
+// Care bits of a region for the packed planes, nullptr if the whole mask box is compared.
+static inline const uint64_t* GetCareBits(const TriggerTable& table, const MaskRegion& region)
+{
+  return region.careMask >= 0 ? table.careMasks[region.careMask].bits.data() : nullptr;
+}
+
+// Number of compared pixels in which the frame differs from a packed capture, stops counting above limit.
+template <MatchMode Mode>
+static uint32_t Distance(const uint64_t* pPacked, uint16_t width, const MaskRegion& region, const FuzzyRegion& fuzzy,
+                         const uint64_t* pCare, const uint64_t* pBits, uint32_t limit)
+{
+  constexpr uint8_t planes = Mode == MatchMode::Boolean ? 1 : 4;
+  uint64_t row[PUPDMD_MAX_WIDTH / 64 * 4];
+  uint32_t distance = 0;
+  for (uint16_t y = 0; y < region.maskHeight && distance <= limit; y++, pBits += planes * fuzzy.rowWords)
+  {
+    ExtractRegionRow(pPacked, width, planes, region.maskX, region.maskY + y, region.maskWidth,
+                     pCare ? &pCare[(size_t)y * fuzzy.rowWords] : nullptr, row);
+    for (uint16_t i = 0; i < fuzzy.rowWords; i++)
+    {
+      // A pixel differs if any of its bitplanes does.
+      uint64_t diff = 0;
+      for (uint8_t plane = 0; plane < planes; plane++)
+      {
+        diff |= row[plane * fuzzy.rowWords + i] ^ pBits[plane * fuzzy.rowWords + i];
+      }
+      distance += std::popcount(diff);
+    }
+  }
+
+  return distance;
+}
+
+// Fallback of boolean and indexed matching if no capture of the resolution matches exactly, see DMD::SetTolerance().
+// Column is the one of TriggerTable::hashes the frame is matched against.
+template <MatchMode Mode, int Column = (int)Mode>
+static bool FindNearest(const TriggerTable& table, const Resolution& resolution, const uint64_t* pPacked,
+                        uint16_t width, uint16_t* pTriggerID, ScanCounts* pCounts)
+{
+  constexpr int f = Column == s_boolean565Column ? 2 : (Mode == MatchMode::Boolean ? 0 : 1);
+  constexpr uint8_t planes = Mode == MatchMode::Boolean ? 1 : 4;
+
+  bool found = false;
+  uint32_t best = table.tolerance;
+  auto compare = [&](const MaskRegion& region, const FuzzyRegion& fuzzy, const FuzzyTrigger& trigger)
+  {
+    pCounts->triggers++;
+    const uint32_t distance =
+        Distance<Mode>(pPacked, width, region, fuzzy, GetCareBits(table, region), trigger.pBits, best);
+    if (distance < best || (distance == best && (!found || trigger.triggerID < *pTriggerID)))
+    {
+      found = true;
+      best = distance;
+      *pTriggerID = trigger.triggerID;
+    }
+  };
+
+  const MaskRegion* pRegion = &table.regions[resolution.firstRegion];
+  for (uint16_t r = 0; r < resolution.regionCount; r++, pRegion++)
+  {
+    if (pRegion->fuzzy < 0) continue;
+
+    const FuzzyRegion& fuzzy = table.fuzzyRegions[pRegion->fuzzy];
+    const FuzzyTrigger* pTriggers = &table.fuzzyTriggers[f][fuzzy.first[f]];
+    if (!fuzzy.bands)
+    {
+      for (uint32_t i = 0; i < fuzzy.count[f]; i++) compare(*pRegion, fuzzy, pTriggers[i]);
+      continue;
+    }
+
+    const auto* pBegin = table.bandKeys[f].data() + fuzzy.keyFirst[f];
+    const auto* pEnd = pBegin + fuzzy.keyCount[f];
+    const uint64_t* pCare = GetCareBits(table, *pRegion);
+    uint64_t row[PUPDMD_MAX_WIDTH / 64 * 4];
+    uint64_t bandHashes[PUPDMD_MAX_HEIGHT];
+    for (uint16_t band = 0; band < fuzzy.bands; band++)
+    {
+      komihash_stream_t ctx;
+      komihash_stream_init(&ctx, band);
+      const uint16_t end = (uint32_t)(band + 1) * pRegion->maskHeight / fuzzy.bands;
+      for (uint16_t y = (uint32_t)band * pRegion->maskHeight / fuzzy.bands; y < end; y++)
+      {
+        ExtractRegionRow(pPacked, width, planes, pRegion->maskX, pRegion->maskY + y, pRegion->maskWidth,
+                         pCare ? &pCare[(size_t)y * fuzzy.rowWords] : nullptr, row);
+        komihash_stream_update(&ctx, row, (size_t)planes * fuzzy.rowWords * sizeof(uint64_t));
+      }
+      pCounts->hashes[(int)Mode]++;
+
+      bandHashes[band] = komihash_stream_final(&ctx);
+      const std::pair<uint64_t, uint32_t> key(bandHashes[band], 0);
+      for (const auto* pKey = std::lower_bound(pBegin, pEnd, key); pKey != pEnd && pKey->first == key.first; pKey++)
+      {
+        // A capture sharing several bands with the frame is compared at the first of them only.
+        bool compared = false;
+        for (uint16_t previous = 0; previous < band && !compared; previous++)
+        {
+          compared = std::binary_search(pBegin, pEnd, std::make_pair(bandHashes[previous], pKey->second));
+        }
+        if (!compared) compare(*pRegion, fuzzy, table.fuzzyTriggers[f][pKey->second]);
+      }
+    }
+  }
+
+  if (found) pCounts->tolerant++;
+
+  return found;
+}
+
+// Words of scratch space the prefix sums of a frame need at most, see BuildPrefixSums().
+static size_t PrefixSumsSize(uint16_t width, uint16_t height) { return ((size_t)width + 1) * (height + 1) * 2; }
+
+// Prefix sums of a frame for RegionHashing::PrefixSum, only kept at the mask box edges of the resolution: entry
+// row * prefixColumns + column is the sum of value * X^x * Y^y of the pixels between the first edges and the given
+// ones, as an unreduced Sum128 of two words. Pixels above or left of the first edges cancel out in every region.
+// forEachPixel(y, x0, x1, add) calls add(x, value) for the pixels of row y in [x0, x1), it may skip the ones of
+// value 0 or add a pixel in several parts. Values are below 2^24.
+template <typename ForEachPixel>
+static void BuildPrefixSums(const TriggerTable& table, const Resolution& resolution, uint64_t* pSums,
+                            ForEachPixel forEachPixel)
+{
+  const uint16_t* pColumns = &table.prefixEdges[resolution.firstPrefixEdge];
+  const uint16_t* pRows = pColumns + resolution.prefixColumns;
+  const uint64_t* pWeights = &table.prefixWeights[resolution.firstPrefixWeight];
+  const size_t rowSize = (size_t)resolution.prefixColumns * 2;
+
+  // Row r holds the pixels above pRows[r], it goes on from the sums of the row before.
+  memset(pSums, 0, rowSize * 2 * sizeof(uint64_t));
+  uint64_t* pRow = pSums + rowSize;
+  for (uint16_t y = pRows[0], r = 1;; y++)
+  {
+    if (y == pRows[r])
+    {
+      if (++r == resolution.prefixRows) break;
+      memcpy(pRow + rowSize, pRow, rowSize * sizeof(uint64_t));
+      pRow += rowSize;
+    }
+
+    // Column 0 is the first edge and stays zero.
+    const uint64_t* pRowWeights = &pWeights[(size_t)y * resolution.width];
+    Sum128 sum;
+    for (uint16_t column = 1; column < resolution.prefixColumns; column++)
+    {
+      forEachPixel(y, pColumns[column - 1], pColumns[column],
+                   [&](uint16_t x, uint64_t value) { sum.MulAdd(value, pRowWeights[x]); });
+      if (sum.IsZero()) continue;
+
+      Sum128 total{pRow[column * 2], pRow[(column * 2) + 1]};
+      total.Add(sum);
+      pRow[column * 2] = total.low;
+      pRow[(column * 2) + 1] = total.high;
+    }
+  }
+}
+
+// Prefix sums of a color frame, the pixel values are the ones of Hash::exactColorPrefixHash or, for RGB565 frames,
+// Hash::rgb565PrefixHash. pPalette is the one FillPalette() expanded.
+static void BuildColorPrefixSums(const TriggerTable& table, const Resolution& resolution, const uint8_t* pFrame,
+                                 ColorFormat color, const uint8_t* pPalette, uint64_t* pSums)
+{
+  const size_t width = resolution.width;
+  const auto rgb = [](const uint8_t* pPixel) { return ((uint64_t)pPixel[0] << 16) | (pPixel[1] << 8) | pPixel[2]; };
+  switch (color)
+  {
+    case ColorFormat::RGB24:
+      BuildPrefixSums(table, resolution, pSums,
+                      [&](uint16_t y, uint16_t x0, uint16_t x1, auto add)
+                      {
+                        const uint8_t* pRow = &pFrame[(size_t)y * width * 3];
+                        for (uint16_t x = x0; x < x1; x++) add(x, rgb(&pRow[x * 3]));
+                      });
+      break;
+    case ColorFormat::RGB565:
+      BuildPrefixSums(table, resolution, pSums,
+                      [&](uint16_t y, uint16_t x0, uint16_t x1, auto add)
+                      {
+                        const uint8_t* pRow = &pFrame[(size_t)y * width * 2];
+                        for (uint16_t x = x0; x < x1; x++)
+                        {
+                          uint16_t value;
+                          memcpy(&value, &pRow[x * 2], sizeof(value));
+                          add(x, value);
+                        }
+                      });
+      break;
+    case ColorFormat::Palette:
+      BuildPrefixSums(table, resolution, pSums,
+                      [&](uint16_t y, uint16_t x0, uint16_t x1, auto add)
+                      {
+                        const uint8_t* pRow = &pFrame[(size_t)y * width];
+                        for (uint16_t x = x0; x < x1; x++) add(x, rgb(&pPalette[pRow[x] * 3]));
+                      });
+      break;
+  }
+}
+
+// Prefix sums of a packed frame, the pixel values are the ones of Hash::booleanPrefixHash or Hash::indexedPrefixHash.
+// Every plane adds its set bits on its own, which skips dark pixels 64 at a time.
+static void BuildPackedPrefixSums(const TriggerTable& table, const Resolution& resolution, const uint64_t* pPacked,
+                                  uint8_t planes, uint64_t* pSums)
+{
+  const uint16_t rowWords = RowWords(resolution.width);
+  BuildPrefixSums(table, resolution, pSums,
+                  [&](uint16_t y, uint16_t x0, uint16_t x1, auto add)
+                  {
+                    const uint64_t* pRow = &pPacked[(size_t)y * planes * rowWords];
+                    for (uint16_t word = x0 / 64; word <= (x1 - 1) / 64; word++)
+                    {
+                      uint64_t segment = ~0ull;
+                      if (word == x0 / 64) segment &= ~0ull << (x0 % 64);
+                      if (word == (x1 - 1) / 64 && x1 % 64) segment &= ~(~0ull << (x1 % 64));
+
+                      for (uint8_t plane = 0; plane < planes; plane++)
+                      {
+                        for (uint64_t bits = pRow[plane * rowWords + word] & segment; bits; bits &= bits - 1)
+                        {
+                          add((uint16_t)(word * 64 + std::countr_zero(bits)), 1ull << plane);
+                        }
+                      }
+                    }
+                  });
+}
+
+// Hash of the mask rectangle of a region from the prefix sums of a frame. Scaled by MaskRegion::prefixScale it
+// counts from the top left corner of the rectangle like Hash::exactColorPrefixHash.
+static inline uint64_t HashRegionPrefix(const Resolution& resolution, const MaskRegion& region, const uint64_t* pSums)
+{
+  const auto sum = [&](uint16_t row, uint16_t column)
+  {
+    const uint64_t* pEntry = &pSums[(((size_t)row * resolution.prefixColumns) + column) * 2];
+    return Sum128{pEntry[0], pEntry[1]}.Reduce();
+  };
+  // Every sum is below the modulus, adding it twice keeps the difference positive.
+  const uint64_t hash =
+      ReduceMod61(sum(region.prefixBottom, region.prefixRight) + sum(region.prefixTop, region.prefixLeft) +
+                  (2 * s_prefixModulus) - sum(region.prefixBottom, region.prefixLeft) -
+                  sum(region.prefixTop, region.prefixRight));
+
+  return MulMod61(hash, region.prefixScale);
+}
+
+// First and last position at which two byte ranges differ. Returns false if they are equal.
+static inline bool FindChangedBytes(const uint8_t* pA, const uint8_t* pB, size_t size, size_t* pFirst, size_t* pLast)
+{
+  size_t first = 0;
+  size_t last = size;
+
+#if defined(PUPDMD_SSE2)
+  for (; first + 16 <= size; first += 16)
+  {
+    const __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&pA[first]),
+                                         _mm_loadu_si128((const __m128i*)&pB[first]));
+    if (_mm_movemask_epi8(equal) != 0xFFFF) break;
+  }
+#elif defined(PUPDMD_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+  for (; first + 16 <= size; first += 16)
+  {
+    if (vminvq_u8(vceqq_u8(vld1q_u8(&pA[first]), vld1q_u8(&pB[first]))) != 0xFF) break;
+  }
+#endif
+
+  while (first < size && pA[first] == pB[first]) first++;
+  if (first == size) return false;
+
+#if defined(PUPDMD_SSE2)
+  for (; last >= first + 16; last -= 16)
+  {
+    const __m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&pA[last - 16]),
+                                         _mm_loadu_si128((const __m128i*)&pB[last - 16]));
+    if (_mm_movemask_epi8(equal) != 0xFFFF) break;
+  }
+#elif defined(PUPDMD_NEON) && (defined(__aarch64__) || defined(_M_ARM64))
+  for (; last >= first + 16; last -= 16)
+  {
+    if (vminvq_u8(vceqq_u8(vld1q_u8(&pA[last - 16]), vld1q_u8(&pB[last - 16]))) != 0xFF) break;
+  }
+#endif
+
+  while (pA[last - 1] == pB[last - 1]) last--;
+
+  *pFirst = first;
+  *pLast = last - 1;
+  return true;
+}
+
+// Size of a pixel in bits and number of planes of height rows each of a frame as passed to a match function.
+static void GetPixelLayout(MatchMode mode, const FrameFormat& format, uint8_t* pBits, uint8_t* pPlanes)
+{
+  *pPlanes = 1;
+  if (mode != MatchMode::Indexed)
+  {
+    *pBits = format.color == ColorFormat::RGB24 ? 24 : (format.color == ColorFormat::RGB565 ? 16 : 8);
+  }
+  else if (format.layout == IndexedLayout::Bytes)
+  {
+    *pBits = 8;
+  }
+  else if (IsPlanar(format.layout))
+  {
+    *pBits = 1;
+    *pPlanes = LayoutBits(format.layout);
+  }
+  else
+  {
+    *pBits = LayoutBits(format.layout);
+  }
+}
+
+// Compares a frame against the previous one and stores the first and last changed column of every row to
+// pDirtyRows, two values per row, first > last for an unchanged row. Returns false if nothing changed.
+static bool FindDirtyRows(const uint8_t* pPrevious, const uint8_t* pFrame, uint16_t width, uint16_t height,
+                          uint8_t bitsPerPixel, uint8_t planes, uint16_t* pDirtyRows)
+{
+  for (uint32_t y = 0; y < height; y++)
+  {
+    pDirtyRows[y * 2] = UINT16_MAX;
+    pDirtyRows[(y * 2) + 1] = 0;
+  }
+
+  bool dirty = false;
+  const size_t rowBytes = (size_t)width * bitsPerPixel / 8;
+  for (uint32_t row = 0; row < (uint32_t)planes * height; row++)
+  {
+    size_t first;
+    size_t last;
+    if (!FindChangedBytes(&pPrevious[row * rowBytes], &pFrame[row * rowBytes], rowBytes, &first, &last)) continue;
+
+    const uint32_t y = row % height;
+    const uint16_t x0 = (uint16_t)(first * 8 / bitsPerPixel);
+    const uint16_t x1 = (uint16_t)std::min<size_t>(width - 1, ((last + 1) * 8 - 1) / bitsPerPixel);
+    pDirtyRows[y * 2] = std::min(pDirtyRows[y * 2], x0);
+    pDirtyRows[(y * 2) + 1] = std::max(pDirtyRows[(y * 2) + 1], x1);
+    dirty = true;
+  }
+
+  return dirty;
+}
+
+// Whether a changed pixel of pDirtyRows lies in the mask box of a region.
+static inline bool IsDirty(const MaskRegion& region, const uint16_t* pDirtyRows, uint16_t width, uint16_t height)
+{
+  const uint16_t x = region.mask ? region.maskX : 0;
+  const uint16_t y = region.mask ? region.maskY : 0;
+  const uint32_t right = region.mask ? (uint32_t)region.maskX + region.maskWidth : width;
+  const uint32_t bottom = region.mask ? (uint32_t)region.maskY + region.maskHeight : height;
+  for (uint32_t row = y; row < bottom; row++)
+  {
+    const uint16_t first = pDirtyRows[row * 2];
+    const uint16_t last = pDirtyRows[(row * 2) + 1];
+    if (first <= last && first < right && last >= x) return true;
+  }
+
+  return false;
+}
+
+// Hash of region i of a frame. Without a changed pixel in the region it is taken from pRegionHashes, which holds the
+// ones of the previous frame, otherwise hash() computes it and it is stored there. pDirtyRows is nullptr if there
+// is no usable previous frame, pRegionHashes if the caller keeps none.
+template <MatchMode Mode, typename HashFunction>
+static inline uint64_t GetRegionHash(const MaskRegion& region, uint16_t i, uint16_t width, uint16_t height,
+                                     const uint16_t* pDirtyRows, uint64_t* pRegionHashes, ScanCounts* pCounts,
+                                     HashFunction hash)
+{
+  if (pDirtyRows && !IsDirty(region, pDirtyRows, width, height))
+  {
+    pCounts->reused++;
+    return pRegionHashes[i];
+  }
+
+  const uint64_t regionHash = hash();
+  pCounts->hashes[(int)Mode]++;
+  if (pRegionHashes) pRegionHashes[i] = regionHash;
+
+  return regionHash;
+}
+
+// Exact color hash of a region, straight from the RGB frame.
+static inline uint64_t HashRegionRGB(const TriggerTable& table, const MaskRegion& region, const uint8_t* pFrame,
+                                     uint16_t width, uint16_t height)
+{
+  if (region.careMask >= 0)
+  {
+    return HashCareRegion(pFrame, width, 3, region.maskX, region.maskY, region.maskWidth, region.maskHeight,
+                          table.careMasks[region.careMask].rgb.data());
+  }
+  if (region.mask)
+  {
+    return HashRegion(pFrame, width, 3, region.maskX, region.maskY, region.maskWidth, region.maskHeight);
+  }
+
+  return komihash(pFrame, (size_t)width * height * 3, 0);
+}
+
+// Boolean or indexed hash of a region over the packed frame.
+static inline uint64_t HashRegionPacked(const TriggerTable& table, const MaskRegion& region, const uint64_t* pPacked,
+                                        uint8_t planes, uint16_t width)
+{
+  return HashPackedRegion(pPacked, width, planes, region.maskX, region.maskY, region.maskWidth, region.maskHeight,
+                          GetCareBits(table, region));
+}
+
+// Exact color hash of a region of a RGB565 frame, compared against Hash::rgb565Hash.
+static inline uint64_t HashRegionRGB565(const TriggerTable& table, const MaskRegion& region, const uint8_t* pFrame,
+                                        uint16_t width, uint16_t height)
+{
+  if (region.careMask >= 0)
+  {
+    return HashCareRegion(pFrame, width, 2, region.maskX, region.maskY, region.maskWidth, region.maskHeight,
+                          table.careMasks[region.careMask].rgb565.data());
+  }
+  if (region.mask)
+  {
+    return HashRegion(pFrame, width, 2, region.maskX, region.maskY, region.maskWidth, region.maskHeight);
+  }
+
+  return komihash(pFrame, (size_t)width * height * 2, 0);
+}
+
+// Exact color hash of a region of a palette frame. The rows are expanded to RGB24 one at a time and streamed, so the
+// digest equals HashRegionRGB() of the expanded frame without expanding it.
+static inline uint64_t HashRegionPalette(const TriggerTable& table, const MaskRegion& region, const uint8_t* pFrame,
+                                         const uint8_t* pPalette, uint16_t width, uint16_t height)
+{
+  const uint16_t x = region.mask ? region.maskX : 0;
+  const uint16_t y = region.mask ? region.maskY : 0;
+  const uint16_t regionWidth = region.mask ? region.maskWidth : width;
+  const uint16_t regionHeight = region.mask ? region.maskHeight : height;
+  const uint8_t* pCare = region.careMask >= 0 ? table.careMasks[region.careMask].rgb.data() : nullptr;
+  const size_t rowLength = (size_t)regionWidth * 3;
+
+  uint8_t row[PUPDMD_MAX_WIDTH * 3];
+  komihash_stream_t ctx;
+  komihash_stream_init(&ctx, 0);
+  for (uint16_t r = 0; r < regionHeight; r++)
+  {
+    const uint8_t* pIn = &pFrame[((size_t)(y + r) * width) + x];
+    for (uint16_t i = 0; i < regionWidth; i++) memcpy(&row[i * 3], &pPalette[pIn[i] * 3], 3);
+    if (pCare)
+    {
+      AndBytes(row, pCare, row, rowLength);
+      pCare += rowLength;
+    }
+    komihash_stream_update(&ctx, row, rowLength);
+  }
+
+  return komihash_stream_final(&ctx);
+}
+
+// Exact color matching of RGB565 and palette frames. The generic counterpart of the exact color kernels, these
+// formats are rare enough to not need one per resolution.
+static bool FindColorTrigger(const TriggerTable& table, const Resolution& resolution, const uint8_t* pFrame,
+                             const FrameFormat& format, uint64_t* pPrefixSums, const uint16_t* pDirtyRows,
+                             uint64_t* pRegionHashes, uint16_t* pTriggerID, ScanCounts* pCounts)
+{
+  const int column = format.color == ColorFormat::RGB565 ? s_rgb565Column : (int)MatchMode::ExactColor;
+  uint8_t palette[256 * 3];
+  if (format.color == ColorFormat::Palette) FillPalette(format, palette);
+
+  bool summed = false;
+  bool found = false;
+  const MaskRegion* pRegion = &table.regions[resolution.firstRegion];
+  for (uint16_t i = 0; i < resolution.regionCount; i++, pRegion++)
+  {
+    const uint64_t regionHash = GetRegionHash<MatchMode::ExactColor>(
+        *pRegion, i, resolution.width, resolution.height, pDirtyRows, pRegionHashes, pCounts,
+        [&]
+        {
+          if (pRegion->prefixScale)
+          {
+            if (!summed)
+            {
+              BuildColorPrefixSums(table, resolution, pFrame, format.color, palette, pPrefixSums);
+              summed = true;
+            }
+            return HashRegionPrefix(resolution, *pRegion, pPrefixSums);
+          }
+
+          return format.color == ColorFormat::RGB565
+                     ? HashRegionRGB565(table, *pRegion, pFrame, resolution.width, resolution.height)
+                     : HashRegionPalette(table, *pRegion, pFrame, palette, resolution.width, resolution.height);
+        });
+
+    pCounts->triggers += pRegion->count[column];
+
+    uint16_t triggerID;
+    if (FindHash(table, *pRegion, column, regionHash, &triggerID) && (!found || triggerID < *pTriggerID))
+    {
+      found = true;
+      *pTriggerID = triggerID;
+    }
+  }
+
+  return found;
+}
+
+// Matches one frame against all regions of a resolution. W and H are compile time constants for the common
+// resolutions, so the frame geometry folds into the hashing loops. W = H = 0 is the generic kernel that reads them
+// from the resolution. Exact color mode hashes pFrame, the other modes the planes FindTrigger() packed to pPackedFrame.
+// Regions without a changed pixel reuse their hash, see GetRegionHash(). pPrefixSums is filled with the ones of the
+// frame before the first region with a MaskRegion::prefixScale is hashed. Column is the one of TriggerTable::hashes
+// the region hashes are looked up in.
+template <uint16_t W, uint16_t H, MatchMode Mode, int Column = (int)Mode>
+static bool FindTriggerIn(const TriggerTable& table, const Resolution& resolution, const uint8_t* pFrame,
+                          uint64_t* pPackedFrame, uint64_t* pPrefixSums, const uint16_t* pDirtyRows,
+                          uint64_t* pRegionHashes, uint16_t* pTriggerID, ScanCounts* pCounts)
+{
+  const uint16_t width = W ? W : resolution.width;
+  const uint16_t height = H ? H : resolution.height;
+
+  bool summed = false;
+  bool found = false;
+  const MaskRegion* pRegion = &table.regions[resolution.firstRegion];
+  for (uint16_t i = 0; i < resolution.regionCount; i++, pRegion++)
+  {
+    const uint64_t regionHash = GetRegionHash<Mode>(
+        *pRegion, i, width, height, pDirtyRows, pRegionHashes, pCounts,
+        [&]
+        {
+          if (pRegion->prefixScale)
+          {
+            if (!summed)
+            {
+              if constexpr (Mode == MatchMode::ExactColor)
+                BuildColorPrefixSums(table, resolution, pFrame, ColorFormat::RGB24, nullptr, pPrefixSums);
+              else
+              {
+                constexpr uint8_t planes = Mode == MatchMode::Boolean ? 1 : 4;
+                BuildPackedPrefixSums(table, resolution, pPackedFrame, planes, pPrefixSums);
+              }
+              summed = true;
+            }
+            return HashRegionPrefix(resolution, *pRegion, pPrefixSums);
+          }
+
+          if constexpr (Mode == MatchMode::ExactColor)
+            return HashRegionRGB(table, *pRegion, pFrame, width, height);
+          else
+          {
+            constexpr uint8_t planes = Mode == MatchMode::Boolean ? 1 : 4;
+            return HashRegionPacked(table, *pRegion, pPackedFrame, planes, width);
+          }
+        });
+
+    pCounts->triggers += pRegion->count[Column];
+
+    uint16_t triggerID;
+    if (FindHash(table, *pRegion, Column, regionHash, &triggerID) && (!found || triggerID < *pTriggerID))
+    {
+      found = true;
+      *pTriggerID = triggerID;
+    }
+  }
+
+  if constexpr (Mode != MatchMode::ExactColor)
+  {
+    // Only a frame without an exact match falls back to the tolerance.
+    if (!found && table.tolerance)
+    {
+      found = FindNearest<Mode, Column>(table, resolution, pPackedFrame, width, pTriggerID, pCounts);
+    }
+  }
+
+  return found;
+}
+
+template <uint16_t W, uint16_t H>
+static void SetKernels(Resolution* pResolution)
+{
+  pResolution->findTrigger[(int)MatchMode::ExactColor] = FindTriggerIn<W, H, MatchMode::ExactColor>;
+  pResolution->findTrigger[(int)MatchMode::Boolean] = FindTriggerIn<W, H, MatchMode::Boolean>;
+  pResolution->findTrigger[(int)MatchMode::Indexed] = FindTriggerIn<W, H, MatchMode::Indexed>;
+}
+
+static void SelectKernels(Resolution* pResolution)
+{
+  const uint32_t size = ((uint32_t)pResolution->width << 16) | pResolution->height;
+  switch (size)
+  {
+    case (128 << 16) | 16:
+      SetKernels<128, 16>(pResolution);
+      break;
+    case (128 << 16) | 32:
+      SetKernels<128, 32>(pResolution);
+      break;
+    case (192 << 16) | 64:
+      SetKernels<192, 64>(pResolution);
+      break;
+    case (256 << 16) | 64:
+      SetKernels<256, 64>(pResolution);
+      break;
+    default:
+      SetKernels<0, 0>(pResolution);
+      break;
+  }
+}
+
+static bool SameRegion(const Hash& a, const Hash& b)
+{
+  return a.width == b.width && a.height == b.height && a.mask == b.mask && a.maskX == b.maskX && a.maskY == b.maskY &&
+         a.maskWidth == b.maskWidth && a.maskHeight == b.maskHeight && std::ranges::equal(a.careMask, b.careMask);
+}
+
+// Order of BuildTable(): by resolution, mask rectangle and care mask.
+static bool RegionLess(const Hash& a, const Hash& b)
+{
+  const auto x = std::tie(a.width, a.height, a.mask, a.maskX, a.maskY, a.maskWidth, a.maskHeight);
+  const auto y = std::tie(b.width, b.height, b.mask, b.maskX, b.maskY, b.maskWidth, b.maskHeight);
+  if (x != y) return x < y;
+  return std::ranges::lexicographical_compare(a.careMask, b.careMask);
+}
+
+// Fills the FuzzyRegion of the triggers order[begin, end), which share one region.
+static void BuildFuzzyRegion(TriggerTable* pTable, MaskRegion* pRegion, const std::vector<uint32_t>& order,
+                             size_t begin, size_t end)
+{
+  const Hash& first = *pTable->entries[order[begin]];
+  FuzzyRegion fuzzy;
+  fuzzy.rowWords = RowWords(first.maskWidth);
+  fuzzy.bands = first.maskHeight > pTable->tolerance ? pTable->tolerance + 1 : 0;
+
+  for (int f = 0; f < 3; f++)
+  {
+    const uint8_t planes = f == 1 ? 4 : 1;
+    const size_t rowSize = (size_t)planes * fuzzy.rowWords;
+    fuzzy.first[f] = (uint32_t)pTable->fuzzyTriggers[f].size();
+    fuzzy.keyFirst[f] = (uint32_t)pTable->bandKeys[f].size();
+
+    for (size_t i = begin; i < end; i++)
+    {
+      const Hash& entry = *pTable->entries[order[i]];
+      const std::span<const uint64_t> bits =
+          f == 0 ? entry.booleanBits : (f == 1 ? entry.indexedBits : GetBoolean565Bits(entry));
+      if (bits.size() != rowSize * entry.maskHeight) continue;
+
+      const uint32_t index = (uint32_t)pTable->fuzzyTriggers[f].size();
+      pTable->fuzzyTriggers[f].push_back({pTable->ids[order[i]], bits.data()});
+      for (uint16_t band = 0; band < fuzzy.bands; band++)
+      {
+        const size_t y = (size_t)band * entry.maskHeight / fuzzy.bands;
+        const size_t rows = (size_t)(band + 1) * entry.maskHeight / fuzzy.bands - y;
+        komihash_stream_t ctx;
+        komihash_stream_init(&ctx, band);
+        komihash_stream_update(&ctx, &bits[y * rowSize], rows * rowSize * sizeof(uint64_t));
+        pTable->bandKeys[f].emplace_back(komihash_stream_final(&ctx), index);
+      }
+    }
+
+    fuzzy.count[f] = (uint32_t)pTable->fuzzyTriggers[f].size() - fuzzy.first[f];
+    fuzzy.keyCount[f] = (uint32_t)pTable->bandKeys[f].size() - fuzzy.keyFirst[f];
+    std::sort(pTable->bandKeys[f].begin() + fuzzy.keyFirst[f], pTable->bandKeys[f].end());
+  }
+
+  pRegion->fuzzy = (int32_t)pTable->fuzzyRegions.size();
+  pTable->fuzzyRegions.push_back(std::move(fuzzy));
+}
+
+// Collects the mask box edges of the regions hashed from prefix sums per resolution, see Resolution::prefixColumns.
+static void BuildPrefixEdges(TriggerTable* pTable)
+{
+  for (auto& resolution : pTable->resolutions)
+  {
+    std::vector<uint16_t> columns;
+    std::vector<uint16_t> rows;
+    MaskRegion* pRegions = &pTable->regions[resolution.firstRegion];
+    for (uint16_t i = 0; i < resolution.regionCount; i++)
+    {
+      if (!pRegions[i].prefixScale) continue;
+      columns.insert(columns.end(), {pRegions[i].maskX, (uint16_t)(pRegions[i].maskX + pRegions[i].maskWidth)});
+      rows.insert(rows.end(), {pRegions[i].maskY, (uint16_t)(pRegions[i].maskY + pRegions[i].maskHeight)});
+    }
+    if (columns.empty()) continue;
+
+    std::sort(columns.begin(), columns.end());
+    columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+    const auto index = [](const std::vector<uint16_t>& edges, uint16_t edge)
+    { return (uint16_t)(std::lower_bound(edges.begin(), edges.end(), edge) - edges.begin()); };
+    for (uint16_t i = 0; i < resolution.regionCount; i++)
+    {
+      MaskRegion& region = pRegions[i];
+      if (!region.prefixScale) continue;
+      region.prefixLeft = index(columns, region.maskX);
+      region.prefixRight = index(columns, region.maskX + region.maskWidth);
+      region.prefixTop = index(rows, region.maskY);
+      region.prefixBottom = index(rows, region.maskY + region.maskHeight);
+    }
+
+    resolution.firstPrefixEdge = (uint32_t)pTable->prefixEdges.size();
+    resolution.prefixColumns = (uint16_t)columns.size();
+    resolution.prefixRows = (uint16_t)rows.size();
+    pTable->prefixEdges.insert(pTable->prefixEdges.end(), columns.begin(), columns.end());
+    pTable->prefixEdges.insert(pTable->prefixEdges.end(), rows.begin(), rows.end());
+
+    const PrefixPowers& powers = GetPrefixPowers();
+    resolution.firstPrefixWeight = (uint32_t)pTable->prefixWeights.size();
+    for (uint16_t y = 0; y < resolution.height; y++)
+    {
+      for (uint16_t x = 0; x < resolution.width; x++)
+      {
+        pTable->prefixWeights.push_back(MulMod61(powers.x[x], powers.y[y]));
+      }
+    }
+  }
+}
+
+static void BuildTable(TriggerTable* pTable, uint16_t tolerance, RegionHashing hashing)
+{
+  // A later capture set replaces the trigger IDs of an earlier one.
+  std::map<uint16_t, const Hash*> triggers;
+  for (const auto& source : pTable->sources)
+  {
+    for (const auto& trigger : source->triggers) triggers[trigger.first] = trigger.second.get();
+  }
+
+  pTable->tolerance = tolerance;
+  pTable->hashing = hashing;
+  pTable->ids.reserve(triggers.size());
+  pTable->entries.reserve(triggers.size());
+  for (const auto& pair : triggers)
+  {
+    pTable->ids.push_back(pair.first);
+    pTable->entries.push_back(pair.second);
+  }
+
+  // Group the triggers by resolution, mask rectangle and care mask. The sort is stable, so every group stays ordered
+  // by ID.
+  std::vector<uint32_t> order(pTable->entries.size());
+  for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [pTable](uint32_t a, uint32_t b) { return RegionLess(*pTable->entries[a], *pTable->entries[b]); });
+
+  std::vector<std::pair<uint64_t, uint16_t>> slice;
+  for (size_t begin = 0, end; begin < order.size(); begin = end)
+  {
+    const Hash& hash = *pTable->entries[order[begin]];
+    for (end = begin + 1; end < order.size() && SameRegion(hash, *pTable->entries[order[end]]); end++);
+
+    if (pTable->resolutions.empty() || pTable->resolutions.back().width != hash.width ||
+        pTable->resolutions.back().height != hash.height)
+    {
+      Resolution resolution;
+      resolution.width = hash.width;
+      resolution.height = hash.height;
+      resolution.firstRegion = (uint16_t)pTable->regions.size();
+      SelectKernels(&resolution);
+      pTable->resolutions.push_back(resolution);
+    }
+    pTable->resolutions.back().regionCount++;
+
+    MaskRegion region;
+    region.mask = hash.mask;
+    region.maskX = hash.maskX;
+    region.maskY = hash.maskY;
+    region.maskWidth = hash.maskWidth;
+    region.maskHeight = hash.maskHeight;
+    if (!hash.careMask.empty())
+    {
+      CareMask care;
+      ExpandCareMask(hash.careMask, (uint32_t)hash.maskWidth * hash.maskHeight, 3, &care.rgb);
+      ExpandCareMask(hash.careMask, (uint32_t)hash.maskWidth * hash.maskHeight, 2, &care.rgb565);
+      PackCareMask(hash, &care.bits);
+      region.careMask = (int32_t)pTable->careMasks.size();
+      pTable->careMasks.push_back(std::move(care));
+    }
+    if (tolerance) BuildFuzzyRegion(pTable, &region, order, begin, end);
+    // X and Y are prime to the modulus, so X^-x = X^(modulus - 1 - x).
+    if (hashing == RegionHashing::PrefixSum && region.careMask < 0)
+    {
+      region.prefixScale = MulMod61(PowMod61(s_prefixBaseX, s_prefixModulus - 1 - region.maskX),
+                                    PowMod61(s_prefixBaseY, s_prefixModulus - 1 - region.maskY));
+    }
+
+    for (int mode = 0; mode < 5; mode++)
+    {
+      slice.clear();
+      for (size_t i = begin; i < end; i++)
+      {
+        const Hash& entry = *pTable->entries[order[i]];
+        const uint64_t values[5] = {entry.exactColorHash, entry.booleanHash, entry.indexedHash, entry.rgb565Hash,
+                                    entry.boolean565Hash};
+        const uint64_t prefixValues[5] = {entry.exactColorPrefixHash, entry.booleanPrefixHash,
+                                          entry.indexedPrefixHash, entry.rgb565PrefixHash,
+                                          entry.boolean565PrefixHash};
+        slice.emplace_back(region.prefixScale ? prefixValues[mode] : values[mode], pTable->ids[order[i]]);
+      }
+
+      // Sorting by hash and ID puts the lowest trigger ID of equal hashes first, unique() keeps that one.
+      std::sort(slice.begin(), slice.end());
+      auto last = std::unique(slice.begin(), slice.end(),
+                              [](const auto& a, const auto& b) { return a.first == b.first; });
+
+      region.first[mode] = (uint32_t)pTable->hashes[mode].size();
+      region.count[mode] = (uint32_t)(last - slice.begin());
+      for (auto it = slice.begin(); it != last; ++it)
+      {
+        pTable->hashes[mode].push_back(it->first);
+        pTable->triggerIDs[mode].push_back(it->second);
+      }
+    }
+
+    pTable->regions.push_back(region);
+  }
+
+  if (hashing == RegionHashing::PrefixSum) BuildPrefixEdges(pTable);
+}
+
+// Process wide registry of capture sets, captures and trigger tables, see DMD::SetShareCaptures(). It only holds weak
+// references, everything lives as long as a DMD uses it.
+struct CaptureStore
+{
+  std::mutex mutex;
+  // Capture sets by PupCapture folder and quantization table, see CaptureSetKey().
+  std::map<std::string, std::weak_ptr<const CaptureSet>> sets;
+  // Captures by CaptureKey().
+  std::unordered_multimap<uint64_t, std::weak_ptr<const Hash>> captures;
+  // Trigger tables by their capture sets, tolerance and region hashing.
+  std::map<std::tuple<std::vector<const CaptureSet*>, uint16_t, RegionHashing>, std::weak_ptr<const TriggerTable>>
+      tables;
+};
+
+static CaptureStore& GetCaptureStore()
+{
+  static CaptureStore s_store;
+  return s_store;
+}
+
+static std::atomic<uint64_t> s_tableGeneration = 0;
+
+static std::string CaptureSetKey(const std::string& romPath, const uint8_t* pQuantization)
+{
+  return romPath + '\n' + std::to_string(komihash(pQuantization, 256, 0));
+}
+
+static uint64_t CaptureKey(const Hash& hash)
+{
+  const uint64_t values[7] = {hash.exactColorHash,
+                              hash.booleanHash,
+                              hash.indexedHash,
+                              hash.rgb565Hash,
+                              hash.boolean565Hash,
+                              hash.width | ((uint64_t)hash.height << 16) | ((uint64_t)hash.mask << 32),
+                              hash.maskX | ((uint64_t)hash.maskY << 16) | ((uint64_t)hash.maskWidth << 32) |
+                                  ((uint64_t)hash.maskHeight << 48)};
+  return komihash(values, sizeof(values), 0);
+}
+
+static bool SameCapture(const Hash& a, const Hash& b)
+{
+  return SameRegion(a, b) && a.exactColorHash == b.exactColorHash && a.booleanHash == b.booleanHash &&
+         a.indexedHash == b.indexedHash && a.rgb565Hash == b.rgb565Hash && a.boolean565Hash == b.boolean565Hash &&
+         std::ranges::equal(a.booleanBits, b.booleanBits) && std::ranges::equal(a.indexedBits, b.indexedBits) &&
+         std::ranges::equal(a.boolean565Bits, b.boolean565Bits);
+}
+
+template <typename Map>
+static void EraseExpired(Map* pMap)
+{
+  for (auto it = pMap->begin(); it != pMap->end();) it = it->second.expired() ? pMap->erase(it) : std::next(it);
+}
+
+// Capture set of a folder some DMD still uses, nullptr if there is none or if its captures changed since.
+static std::shared_ptr<const CaptureSet> FindCaptureSet(const std::string& key, const std::string& files)
+{
+  CaptureStore& store = GetCaptureStore();
+  std::lock_guard<std::mutex> lock(store.mutex);
+  auto it = store.sets.find(key);
+  std::shared_ptr<const CaptureSet> set = it != store.sets.end() ? it->second.lock() : nullptr;
+  return set && set->files == files ? set : nullptr;
+}
+
+// Turns freshly loaded triggers into a capture set, reusing every capture that is already in the store. The set is
+// registered under key unless key is empty. If another DMD registered the same unchanged folder meanwhile, that set
+// wins.
+static std::shared_ptr<const CaptureSet> AddCaptureSet(const std::string& key, CaptureData&& data)
+{
+  CaptureStore& store = GetCaptureStore();
+  std::lock_guard<std::mutex> lock(store.mutex);
+
+  if (!key.empty())
+  {
+    auto it = store.sets.find(key);
+    if (it != store.sets.end())
+    {
+      auto set = it->second.lock();
+      if (set && set->files == data.files) return set;
+    }
+  }
+
+  EraseExpired(&store.captures);
+
+  auto set = std::make_shared<CaptureSet>();
+  set->folder = std::move(data.folder);
+  set->files = std::move(data.files);
+  set->triggers.reserve(data.triggers.size());
+  for (auto& pair : data.triggers)
+  {
+    const uint64_t captureKey = CaptureKey(pair.second.hash);
+    std::shared_ptr<const Hash> capture;
+    for (auto [it, end] = store.captures.equal_range(captureKey); it != end && !capture; ++it)
+    {
+      capture = it->second.lock();
+      if (capture && !SameCapture(*capture, pair.second.hash)) capture.reset();
+    }
+    if (!capture)
+    {
+      auto stored = std::make_shared<const StoredCapture>(std::move(pair.second));
+      capture = std::shared_ptr<const Hash>(stored, &stored->hash);
+      store.captures.emplace(captureKey, capture);
+    }
+    set->triggers.emplace_back(pair.first, std::move(capture));
+  }
+
+  if (!key.empty())
+  {
+    EraseExpired(&store.sets);
+    store.sets[key] = set;
+  }
+
+  return set;
+}
+
+// Trigger table of the capture sets with the tolerance and region hashing, shared with every DMD that uses the same
+// ones.
+static std::shared_ptr<const TriggerTable> GetTable(std::vector<std::shared_ptr<const CaptureSet>> sources,
+                                                    uint16_t tolerance, RegionHashing hashing)
+{
+  CaptureStore& store = GetCaptureStore();
+  std::tuple<std::vector<const CaptureSet*>, uint16_t, RegionHashing> key({}, tolerance, hashing);
+  for (const auto& source : sources) std::get<0>(key).push_back(source.get());
+
+  {
+    std::lock_guard<std::mutex> lock(store.mutex);
+    auto it = store.tables.find(key);
+    if (it != store.tables.end())
+    {
+      if (auto table = it->second.lock()) return table;
+    }
+  }
+
+  // Built without holding the lock, Load() of other DMDs goes on meanwhile.
+  auto table = std::make_shared<TriggerTable>();
+  table->generation = ++s_tableGeneration;
+  table->sources = std::move(sources);
+  BuildTable(table.get(), tolerance, hashing);
+
+  std::lock_guard<std::mutex> lock(store.mutex);
+  EraseExpired(&store.tables);
+  auto& entry = store.tables[key];
+  if (auto other = entry.lock()) return other;
+  entry = table;
+
+  return table;
+}
+
+// Words of scratch space FindTrigger() and FindTriggers() need for a frame: the packed boolean plane followed by the
+// four packed indexed planes.
+static size_t PackedFrameSize(uint16_t width, uint16_t height) { return (size_t)RowWords(width) * height * 5; }
+
+// pDirtyRows and pRegionHashes are the ones of GetRegionHash(), both may be nullptr. pPrefixSums holds
+// PrefixSumsSize() words if the table uses RegionHashing::PrefixSum.
+static bool FindTrigger(const TriggerTable& table, const uint8_t* pFrame, uint16_t width, uint16_t height,
+                        MatchMode mode, const FrameFormat& format, uint64_t* pPackedFrame, uint64_t* pPrefixSums,
+                        const uint16_t* pDirtyRows, uint64_t* pRegionHashes, uint16_t* pTriggerID,
+                        ScanCounts* pCounts)
+{
+  const Resolution* pResolution = FindResolution(table, width, height);
+  if (!pResolution) return false;
+
+  if (mode == MatchMode::ExactColor && format.color != ColorFormat::RGB24)
+  {
+    return FindColorTrigger(table, *pResolution, pFrame, format, pPrefixSums, pDirtyRows, pRegionHashes, pTriggerID,
+                            pCounts);
+  }
+
+  // The packed planes are built once and shared by all regions.
+  if (mode == MatchMode::Boolean) PackBooleanFrame(pFrame, width, height, format, pPackedFrame);
+  if (mode == MatchMode::Indexed) PackIndexedFrame(pFrame, width, height, format.layout, pPackedFrame);
+
+  // RGB565 turns the darkest colors black, so these frames are compared against the captures converted to RGB565.
+  // They are rare enough for the generic kernel.
+  if (mode == MatchMode::Boolean && format.color == ColorFormat::RGB565)
+  {
+    return FindTriggerIn<0, 0, MatchMode::Boolean, s_boolean565Column>(
+        table, *pResolution, pFrame, pPackedFrame, pPrefixSums, pDirtyRows, pRegionHashes, pTriggerID, pCounts);
+  }
+
+  return pResolution->findTrigger[(int)mode](table, *pResolution, pFrame, pPackedFrame, pPrefixSums, pDirtyRows,
+                                             pRegionHashes, pTriggerID, pCounts);
+}
+
+// ppDirtyRows and ppRegionHashes hold the arguments of GetRegionHash() per mode. pPrefixSums holds three times
+// PrefixSumsSize() words if the table uses RegionHashing::PrefixSum, one set per mode.
+static void FindTriggers(const TriggerTable& table, const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width,
+                         uint16_t height, const bool* pModes, uint64_t* pPackedFrame, uint64_t* pPrefixSums,
+                         const uint16_t* const* ppDirtyRows, uint64_t* const* ppRegionHashes, bool* pFound,
+                         uint16_t* pTriggerIDs, ScanCounts* pCounts)
+{
+  const Resolution* pResolution = FindResolution(table, width, height);
+  if (!pResolution) return;
+
+  // Pack the boolean and indexed planes once, every region of every mode is then hashed from them or the RGB frame.
+  uint64_t* pPackedBoolean = pPackedFrame;
+  uint64_t* pPackedIndexed = pPackedFrame + (size_t)RowWords(width) * height;
+  if (pModes[1]) PackBooleanFrame(pFrame, width, height, pPackedBoolean);
+  if (pModes[2]) PackIndexedFrame(pIndexedFrame, width, height, pPackedIndexed);
+
+  bool summed[3] = {false, false, false};
+  const MaskRegion* pRegion = &table.regions[pResolution->firstRegion];
+  for (uint16_t r = 0; r < pResolution->regionCount; r++, pRegion++)
+  {
+    for (int i = 0; i < 3; i++)
+    {
+      if (!pModes[i]) continue;
+
+      const auto hash = [&]
+      {
+        if (pRegion->prefixScale)
+        {
+          uint64_t* pSums = &pPrefixSums[PrefixSumsSize(width, height) * i];
+          if (!summed[i])
+          {
+            if (i == 0)
+              BuildColorPrefixSums(table, *pResolution, pFrame, ColorFormat::RGB24, nullptr, pSums);
+            else
+              BuildPackedPrefixSums(table, *pResolution, i == 1 ? pPackedBoolean : pPackedIndexed, i == 1 ? 1 : 4,
+                                    pSums);
+            summed[i] = true;
+          }
+          return HashRegionPrefix(*pResolution, *pRegion, pSums);
+        }
+
+        if (i == 0) return HashRegionRGB(table, *pRegion, pFrame, width, height);
+        if (i == 1) return HashRegionPacked(table, *pRegion, pPackedBoolean, 1, width);
+        return HashRegionPacked(table, *pRegion, pPackedIndexed, 4, width);
+      };
+      const uint64_t regionHash =
+          i == 0 ? GetRegionHash<MatchMode::ExactColor>(*pRegion, r, width, height, ppDirtyRows[i], ppRegionHashes[i],
+                                                        pCounts, hash)
+          : i == 1 ? GetRegionHash<MatchMode::Boolean>(*pRegion, r, width, height, ppDirtyRows[i], ppRegionHashes[i],
+                                                       pCounts, hash)
+                   : GetRegionHash<MatchMode::Indexed>(*pRegion, r, width, height, ppDirtyRows[i], ppRegionHashes[i],
+                                                       pCounts, hash);
+
+      pCounts->triggers += pRegion->count[i];
+
+      uint16_t triggerID;
+      if (FindHash(table, *pRegion, i, regionHash, &triggerID) && (!pFound[i] || triggerID < pTriggerIDs[i]))
+      {
+        pFound[i] = true;
+        pTriggerIDs[i] = triggerID;
+      }
+    }
+  }
+
+  if (!table.tolerance) return;
+
+  if (pModes[1] && !pFound[1])
+  {
+    pFound[1] = FindNearest<MatchMode::Boolean>(table, *pResolution, pPackedBoolean, width, &pTriggerIDs[1], pCounts);
+  }
+  if (pModes[2] && !pFound[2])
+  {
+    pFound[2] = FindNearest<MatchMode::Indexed>(table, *pResolution, pPackedIndexed, width, &pTriggerIDs[2], pCounts);
+  }
+}
+
+TriggerView::TriggerView(std::shared_ptr<const TriggerTable> table) : m_table(std::move(table)) {}
+
+size_t TriggerView::GetCount() const { return m_table ? m_table->ids.size() : 0; }
+
+TriggerView::Iterator TriggerView::begin() const
+{
+  return m_table ? Iterator(m_table->ids.data(), m_table->entries.data()) : Iterator(nullptr, nullptr);
+}
+
+TriggerView::Iterator TriggerView::end() const
+{
+  return m_table ? Iterator(m_table->ids.data() + m_table->ids.size(), m_table->entries.data() + m_table->ids.size())
+                 : Iterator(nullptr, nullptr);
+}
+
+const Hash* TriggerView::Find(uint16_t triggerID) const
+{
+  if (!m_table) return nullptr;
+
+  auto it = std::lower_bound(m_table->ids.begin(), m_table->ids.end(), triggerID);
+  if (it == m_table->ids.end() || *it != triggerID) return nullptr;
+
+  return m_table->entries[it - m_table->ids.begin()];
+}
+
+DMD::DMD() { m_pDefaultSession = CreateSession(); }
+
+DMD::~DMD()
+{
+  StopAsync();
+  StopRecording();
+
+  for (MatchSession* pSession : m_sessions) delete pSession;
+}
+
+MatchSession::MatchSession(DMD* pDMD) : m_pDMD(pDMD) {}
+
+MatchSession::~MatchSession() {}
+
+MatchSession* DMD::CreateSession()
+{
+  MatchSession* pSession = new MatchSession(this);
+
+  std::lock_guard<std::mutex> lock(m_sessionMutex);
+  m_sessions.push_back(pSession);
+
+  return pSession;
+}
+
+void DMD::DestroySession(MatchSession* pSession)
+{
+  if (!pSession || pSession == m_pDefaultSession || pSession == m_pAsyncSession) return;
+
+  {
+    std::lock_guard<std::mutex> lock(m_sessionMutex);
+    auto it = std::find(m_sessions.begin(), m_sessions.end(), pSession);
+    if (it == m_sessions.end()) return;
+    m_sessions.erase(it);
+  }
+
+  delete pSession;
+  ReclaimTables();
+}
+
+// Readers announce the table they are going to use in their session (a hazard pointer) and confirm it is still the
+// published one afterwards. A replaced table is only freed by ReclaimTables() once no session announces it anymore.
+const TriggerTable* DMD::AcquireTable(MatchSession* pSession)
+{
+  const TriggerTable* pTable = m_pTable.load(std::memory_order_acquire);
+  while (true)
+  {
+    pSession->m_pTable.store(pTable, std::memory_order_seq_cst);
+    const TriggerTable* pCurrent = m_pTable.load(std::memory_order_seq_cst);
+    if (pCurrent == pTable) return pTable;
+    pTable = pCurrent;
+  }
+}
+
+void DMD::ReleaseTable(MatchSession* pSession) { pSession->m_pTable.store(nullptr, std::memory_order_release); }
+
+void DMD::PublishTable(std::shared_ptr<const TriggerTable> table)
+{
+  // Called with m_writeMutex held.
+  if (table == m_table) return;
+
+  std::shared_ptr<const TriggerTable> previous = std::move(m_table);
+  m_table = std::move(table);
+  m_pTable.store(m_table.get(), std::memory_order_seq_cst);
+
+  if (!previous) return;
+
+  {
+    std::lock_guard<std::mutex> lock(m_sessionMutex);
+    m_retiredTables.push_back(std::move(previous));
+  }
+  ReclaimTables();
+}
+
+// Frees the replaced tables that no session announces anymore. The others stay retired until the next call from
+// PublishTable() or DestroySession(), so a writer never waits for a session to finish its match.
+void DMD::ReclaimTables()
+{
+  // Released once the lock is dropped, freeing a table takes a while.
+  std::vector<std::shared_ptr<const TriggerTable>> reclaimed;
+  {
+    std::lock_guard<std::mutex> lock(m_sessionMutex);
+    for (auto it = m_retiredTables.begin(); it != m_retiredTables.end();)
+    {
+      const bool used = std::any_of(m_sessions.begin(), m_sessions.end(), [&](const MatchSession* pSession)
+                                    { return pSession->m_pTable.load(std::memory_order_seq_cst) == it->get(); });
+      if (used)
+      {
+        ++it;
+        continue;
+      }
+      reclaimed.push_back(std::move(*it));
+      it = m_retiredTables.erase(it);
+    }
+  }
+}
+
+void DMD::SetLoadThreads(uint8_t threads) { m_loadThreads = threads; }
+
+void DMD::SetUseIndexFile(bool useIndexFile) { m_useIndexFile = useIndexFile; }
+
+void DMD::SetShareCaptures(bool shareCaptures) { m_shareCaptures = shareCaptures; }
+
+void DMD::SetLogCallback(PUPDMD_LogCallback callback, const void* userData)
+{
+  m_logCallback = callback;
+  m_logUserData = userData;
+}
+
+void DMD::Log(const char* format, ...)
+{
+  if (!m_logCallback)
+  {
+    return;
+  }
+
+  // The callback is user code, it is free to allocate.
+  PUPDMD_ALLOW_ALLOCATIONS();
+
+  // Load() workers log concurrently.
+  std::lock_guard<std::mutex> lock(m_logMutex);
+
+  va_list args;
+  va_start(args, format);
+  (*(m_logCallback))(format, args, m_logUserData);
+  va_end(args);
+}
+
+// Builds a red channel -> index table from ascending thresholds: index i covers r < thresholds[i].
+// The red value of the mask color always maps to 0.
+static constexpr std::array<uint8_t, 256> MakeQuantizationTable(const uint8_t* thresholds, uint8_t count)
+{
+  std::array<uint8_t, 256> table{};
+  for (int r = 0; r < 256; r++)
+  {
+    uint8_t index = 0;
+    while (index < count && r >= thresholds[index]) index++;
+    table[r] = (r == PUPDMD_MASK_R) ? 0 : index;
+  }
+  return table;
+}
+
+static constexpr uint8_t s_thresholds2[] = {8, 48, 128};
+static constexpr uint8_t s_thresholds4[] = {8, 24, 48, 56, 72, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240};
+static constexpr std::array<uint8_t, 256> s_quantization2 = MakeQuantizationTable(s_thresholds2, sizeof(s_thresholds2));
+static constexpr std::array<uint8_t, 256> s_quantization4 = MakeQuantizationTable(s_thresholds4, sizeof(s_thresholds4));
+
+bool DMD::SetQuantizationThresholds(uint8_t bitDepth, const uint8_t* thresholds)
+{
+  if (bitDepth != 2 && bitDepth != 4)
+  {
+    Log("Unsupported bit depth for quantization thresholds: %d", bitDepth);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+
+  if (!thresholds)
+  {
+    m_quantizationTables.erase(bitDepth);
+    return true;
+  }
+
+  const uint8_t count = (1 << bitDepth) - 1;
+  for (uint8_t i = 1; i < count; i++)
+  {
+    if (thresholds[i] <= thresholds[i - 1])
+    {
+      Log("Quantization thresholds must be ascending");
+      return false;
+    }
+  }
+
+  m_quantizationTables[bitDepth] = MakeQuantizationTable(thresholds, count);
+
+  return true;
+}
+
+const uint8_t* DMD::GetQuantizationTable(uint8_t bitDepth) const
+{
+  auto it = m_quantizationTables.find(bitDepth);
+  if (it != m_quantizationTables.end()) return it->second.data();
+
+  switch (bitDepth)
+  {
+    case 2:
+      return s_quantization2.data();
+    case 4:
+      return s_quantization4.data();
+    default:
+      return nullptr;
+  }
+}
+
+void DMD::SetTolerance(uint16_t pixels)
+{
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+
+  if (pixels == m_tolerance) return;
+  m_tolerance = pixels;
+  if (!m_table) return;
+
+  // The band index depends on the tolerance, so the current snapshot is rebuilt.
+  PublishTable(GetTable(m_table->sources, m_tolerance, m_regionHashing));
+}
+
+void DMD::SetRegionHashing(RegionHashing hashing)
+{
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+
+  if (hashing == m_regionHashing) return;
+  m_regionHashing = hashing;
+  if (!m_table) return;
+
+  // The regions of the table are sorted by the hashes of the chosen kind.
+  PublishTable(GetTable(m_table->sources, m_tolerance, m_regionHashing));
+}
+
+// Nanoseconds since *pStart, which is moved to now for the next phase.
+static uint64_t Lap(std::chrono::steady_clock::time_point* pStart)
+{
+  const auto now = std::chrono::steady_clock::now();
+  const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - *pStart).count();
+  *pStart = now;
+  return ns;
+}
+
+bool DMD::Load(const char* const puppath, const char* const romname, uint8_t bitDepth)
+{
+  std::string puppathObj(puppath);
+  if (puppathObj.back() != '\\' && puppathObj.back() != '/')
+    puppathObj += '/';
+  puppathObj += std::string(romname);
+  puppathObj += '/';
+
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+
+  auto phaseStart = std::chrono::steady_clock::now();
+
+  const uint8_t* pQuantization = GetQuantizationTable(bitDepth);
+  if (!pQuantization)
+  {
+    Log("Unsupported bit depth %d, falling back to 2 bit", bitDepth);
+    pQuantization = GetQuantizationTable(2);
+  }
+
+  std::optional<std::string> pFolderPath = find_case_insensitive_folder(puppathObj, "PupCapture");
+  if (!pFolderPath) {
+    Log("Directory does not exist: %sPupCapture", puppathObj.c_str());
+    return false;
+  }
+
+  Log("Scanning directory: %s", pFolderPath->c_str());
+
+  // Regular expression to extract numeric part from file name (case insensitive)
+  std::regex pattern(R"((\d+)\.bmp)", std::regex_constants::icase);
+
+  std::vector<CaptureFile> files;
+
+  for (const auto& entry : fs::directory_iterator(*pFolderPath))
+  {
+    std::string filePath = entry.path().string();
+    std::smatch matches;
+    std::string fileName = fs::path(filePath).filename().string();
+
+    if (!std::regex_search(fileName, matches, pattern))
+    {
+      continue;  // Skip files that don't match the pattern
+    }
+
+    std::error_code ec;
+    CaptureFile file;
+    file.fileName = fileName;
+    file.filePath = filePath;
+    file.size = entry.file_size(ec);
+    file.mtime = entry.last_write_time(ec).time_since_epoch().count();
+    file.triggerID = std::stoi(matches[1].str());
+    files.push_back(std::move(file));
+  }
+
+  // Directory iteration order is unspecified. Sorting by file name makes the result independent of the file
+  // system and of the number of threads if several files map to the same trigger ID.
+  std::sort(files.begin(), files.end(),
+            [](const CaptureFile& a, const CaptureFile& b) { return a.fileName < b.fileName; });
+
+  // Name, size and last write time of every capture, the same as the index file checks.
+  std::string listing;
+  for (const auto& file : files)
+  {
+    listing += file.fileName;
+    listing += '\n' + std::to_string(file.size) + '\n' + std::to_string(file.mtime) + '\n';
+  }
+
+  m_counters.loadScanTime.fetch_add(Lap(&phaseStart), std::memory_order_relaxed);
+
+  // A folder that is still loaded, by this or another DMD, is shared without reading a capture as long as none of
+  // them changed.
+  const std::string setKey = m_shareCaptures ? CaptureSetKey(puppathObj, pQuantization) : std::string();
+  std::shared_ptr<const CaptureSet> set = m_shareCaptures ? FindCaptureSet(setKey, listing) : nullptr;
+  if (set)
+  {
+    Log("Reusing %zu loaded PUP DMD triggers of %sPupCapture", set->triggers.size(), puppathObj.c_str());
+  }
+  else
+  {
+    std::string indexPath = *pFolderPath + PUPDMD_INDEX_FILE_NAME;
+    CaptureData data;
+    if (m_useIndexFile && ReadIndexFile(indexPath, files, bitDepth, pQuantization, &data))
+    {
+      m_counters.loadReadTime.fetch_add(Lap(&phaseStart), std::memory_order_relaxed);
+      Log("Loaded %zu PUP DMD triggers from %s", data.triggers.size(), indexPath.c_str());
+    }
+    else
+    {
+      LoadCaptures(files, pQuantization, &data);
+
+      // A folder without usable captures is not worth an index file.
+      if (m_useIndexFile && !data.triggers.empty()) WriteIndexFile(indexPath, files, bitDepth, pQuantization, data);
+    }
+
+    data.folder = puppathObj;
+    data.files = std::move(listing);
+    set = AddCaptureSet(setKey, std::move(data));
+  }
+
+  // The next snapshot merges the folders loaded so far in load order. A folder loaded again moves to the end, so its
+  // triggers replace the ones of other folders with the same ID.
+  std::vector<std::shared_ptr<const CaptureSet>> sources;
+  if (m_table)
+  {
+    for (const auto& source : m_table->sources)
+    {
+      if (source->folder != set->folder) sources.push_back(source);
+    }
+  }
+  sources.push_back(set);
+
+  phaseStart = std::chrono::steady_clock::now();
+  std::shared_ptr<const TriggerTable> table = GetTable(std::move(sources), m_tolerance, m_regionHashing);
+  m_counters.loadIndexTime.fetch_add(Lap(&phaseStart), std::memory_order_relaxed);
+  Log("Indexed %zu PUP DMD triggers in %zu mask regions", table->ids.size(), table->regions.size());
+
+  PublishTable(std::move(table));
+
+  return true;
+}
+
+static inline bool IsMaskColor(const uint8_t* pRGB)
+{
+  return pRGB[0] == PUPDMD_MASK_R && pRGB[1] == PUPDMD_MASK_G && pRGB[2] == PUPDMD_MASK_B;
+}
+
+// Finds the mask of a capture. A mask is a rectangle outline drawn in the mask color, its inside is compared. A
+// single outline gives a plain mask rectangle. Several outlines, or mask colored pixels inside an outline that
+// should be ignored, give a care mask over the bounding box of all outlines, stored in pCareMask. Returns false if
+// the outlines leave no pixel to compare, for example an outline filled with the mask color.
+static bool DetectMask(const uint8_t* pRGB, Hash* pHash, std::vector<uint8_t>* pCareMask)
+{
+  const uint16_t width = pHash->width;
+  const uint16_t height = pHash->height;
+  auto isMask = [&](uint32_t x, uint32_t y) { return IsMaskColor(&pRGB[((size_t)y * width + x) * 3]); };
+
+  struct Rect
+  {
+    uint16_t x, y, width, height;
+  };
+  std::vector<Rect> rects;
+  std::vector<uint8_t> outline((size_t)width * height, 0);
+
+  for (uint32_t y = 0; y < height; y++)
+  {
+    for (uint32_t x = 0; x < width; x++)
+    {
+      if (!isMask(x, y) || outline[(size_t)y * width + x]) continue;
+
+      // Candidate top left corner: follow the top and left edges, then check that the outline is closed.
+      uint32_t right = x;
+      while (right + 1 < width && isMask(right + 1, y)) right++;
+      uint32_t bottom = y;
+      while (bottom + 1 < height && isMask(x, bottom + 1)) bottom++;
+
+      bool closed = right >= x + 2 && bottom >= y + 2;
+      for (uint32_t i = x; closed && i <= right; i++) closed = isMask(i, bottom);
+      for (uint32_t i = y; closed && i <= bottom; i++) closed = isMask(right, i);
+      // Otherwise it is a mask colored pixel that is ignored if it lies inside an outline.
+      if (!closed) continue;
+
+      for (uint32_t i = x; i <= right; i++) outline[(size_t)y * width + i] = outline[(size_t)bottom * width + i] = 1;
+      for (uint32_t i = y; i <= bottom; i++) outline[(size_t)i * width + x] = outline[(size_t)i * width + right] = 1;
+      rects.push_back({(uint16_t)(x + 1), (uint16_t)(y + 1), (uint16_t)(right - x - 1), (uint16_t)(bottom - y - 1)});
+    }
+  }
+
+  if (rects.empty())
+  {
+    pHash->mask = false;
+    pHash->maskX = 0;
+    pHash->maskY = 0;
+    pHash->maskWidth = width;
+    pHash->maskHeight = height;
+    return true;
+  }
+
+  uint16_t left = UINT16_MAX, top = UINT16_MAX, right = 0, bottom = 0;
+  for (const Rect& rect : rects)
+  {
+    left = std::min(left, rect.x);
+    top = std::min(top, rect.y);
+    right = std::max<uint16_t>(right, rect.x + rect.width);
+    bottom = std::max<uint16_t>(bottom, rect.y + rect.height);
+  }
+  pHash->mask = true;
+  pHash->maskX = left;
+  pHash->maskY = top;
+  pHash->maskWidth = right - left;
+  pHash->maskHeight = bottom - top;
+
+  std::vector<uint8_t> careMask(((size_t)pHash->maskWidth * pHash->maskHeight + 7) / 8, 0);
+  bool partial = rects.size() > 1;
+  bool compared = false;
+  for (const Rect& rect : rects)
+  {
+    for (uint32_t y = rect.y; y < (uint32_t)rect.y + rect.height; y++)
+    {
+      for (uint32_t x = rect.x; x < (uint32_t)rect.x + rect.width; x++)
+      {
+        if (isMask(x, y))
+        {
+          partial = true;
+          continue;
+        }
+        const size_t i = (size_t)(y - top) * pHash->maskWidth + (x - left);
+        careMask[i >> 3] |= 1 << (i & 7);
+        compared = true;
+      }
+    }
+  }
+
+  // A single clean rectangle keeps the plain rectangle hashes.
+  if (partial)
+  {
+    *pCareMask = std::move(careMask);
+    pHash->careMask = *pCareMask;
+  }
+
+  // Such a capture would match every frame of its resolution.
+  return compared;
+}
+
+void DMD::LoadCaptures(const std::vector<CaptureFile>& files, const uint8_t* pQuantization, CaptureData* pData)
+{
+  std::vector<LoadedCapture> captures(files.size());
+  std::vector<uint8_t> loaded(files.size(), 0);
+
+  unsigned int threads = m_loadThreads ? m_loadThreads : std::thread::hardware_concurrency();
+  threads = std::max(1u, std::min<unsigned int>(threads, (unsigned int)files.size()));
+
+  std::atomic<size_t> next = 0;
+  auto worker = [&]()
+  {
+    for (size_t i = next++; i < files.size(); i = next++)
+    {
+      loaded[i] = LoadCapture(files[i].filePath, pQuantization, &captures[i]);
+    }
+  };
+
+  if (threads > 1)
+  {
+    std::vector<std::thread> pool;
+    for (unsigned int i = 0; i < threads; i++) pool.emplace_back(worker);
+    for (auto& thread : pool) thread.join();
+  }
+  else
+  {
+    worker();
+  }
+
+  // Merge in file name order, a later file replaces an earlier one with the same trigger ID.
+  std::map<uint16_t, size_t> added;
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    if (!loaded[i]) continue;
+
+    uint16_t triggerID = files[i].triggerID;
+    auto it = added.find(triggerID);
+    if (it != added.end())
+    {
+      Log("Trigger ID %03d of %s replaces %s", triggerID, files[i].fileName.c_str(),
+          files[it->second].fileName.c_str());
+    }
+    added[triggerID] = i;
+
+    // Moving the capture keeps the buffers its spans point into.
+    StoredCapture& stored = pData->triggers[triggerID];
+    auto capture = std::make_shared<const LoadedCapture>(std::move(captures[i]));
+    stored.hash = capture->hash;
+    stored.storage = std::move(capture);
+
+    const Hash& hash = stored.hash;
+    Log("Added PUP DMD %dx%d trigger ID: %03d, mask: %d, x: %03d, y: %03d, width: %03d, height: %03d, "
+        "exactColorHash: %020" PRIu64 ", booleanHash: %020" PRIu64 ", indexedHash: %020" PRIu64,
+        hash.width, hash.height, triggerID, hash.mask, hash.maskX, hash.maskY, hash.maskWidth, hash.maskHeight,
+        hash.exactColorHash, hash.booleanHash, hash.indexedHash);
+  }
+}
+
+bool DMD::LoadCapture(const std::string& filePath, const uint8_t* pQuantization, LoadedCapture* pCapture)
+{
+  auto phaseStart = std::chrono::steady_clock::now();
+
+  std::ifstream file(filePath, std::ios::binary);
+
+  if (!file.is_open())
+  {
+    Log("Error opening file: %s", filePath.c_str());
+    return false;
+  }
+
+  // Read BMP header
+  BMPHeader header;
+  file.read(reinterpret_cast<char*>(&header), sizeof(BMPHeader));
+
+  // Check if file is a BMP file
+  if (header.signature[0] != 'B' || header.signature[1] != 'M')
+  {
+    Log("Not a BMP file: %s", filePath.c_str());
+    return false;
+  }
+
+  if (header.compression != 0)
+  {
+    Log("Compression is not supported: %s", filePath.c_str());
+    return false;
+  }
+
+  // Move file pointer to the beginning of pixel data
+  file.seekg(header.dataOffset, std::ios::beg);
+
+  // Calculate the size of the pixel data
+  size_t pixelDataSize = header.imageSize == 0 ? header.fileSize - header.dataOffset : header.imageSize;
+
+  // BMP rows are padded to 4 bytes.
+  const size_t stride = ((size_t)header.width * 3 + 3) & ~(size_t)3;
+
+  if (header.bpp == 24 && header.width > 0 && header.width <= PUPDMD_MAX_WIDTH && header.height > 0 &&
+      header.height <= PUPDMD_MAX_HEIGHT && pixelDataSize >= stride * header.height)
+  {
+    pixelDataSize = stride * header.height;
+    LoadedCapture capture;
+    PUPDMD::Hash& hash = capture.hash;
+    std::vector<uint8_t> pixelData(pixelDataSize);
+    std::vector<uint8_t> rgb((size_t)header.width * header.height * 3);
+    std::vector<uint8_t> indexed((size_t)header.width * header.height);
+
+    file.read(reinterpret_cast<char*>(pixelData.data()), pixelDataSize);
+    m_counters.loadReadTime.fetch_add(Lap(&phaseStart), std::memory_order_relaxed);
+
+    uint8_t* pRGB = rgb.data();
+    uint8_t* pIndexed = indexed.data();
+    for (uint16_t y = 0; y < header.height; y++)
+    {
+      // BMP starts at the lower left, pinball frames at upper left
+      const uint8_t* pRow = &pixelData[(header.height - 1 - y) * stride];
+      for (uint16_t x = 0; x < header.width; x++)
+      {
+        // Usually the order is BGR in BMP
+        uint8_t b = pRow[x * 3];
+        uint8_t g = pRow[x * 3 + 1];
+        uint8_t r = pRow[x * 3 + 2];
+        *pRGB++ = r;
+        *pRGB++ = g;
+        *pRGB++ = b;
+
+        // Since PupCapture DMDs are orange it is sufficient to look at red
+        *pIndexed++ = pQuantization[r];
+
+        // if (r > 0)
+        //   Log("Found illuminated pixel RGB %03d %03d %03d, converted to index %02d", r, g, b, indexed.back());
+      }
+    }
+
+    hash.width = header.width;
+    hash.height = header.height;
+    if (!DetectMask(rgb.data(), &hash, &capture.careMask))
+    {
+      Log("Mask leaves no pixel to compare: %s", filePath.c_str());
+      return false;
+    }
+    m_counters.loadDecodeTime.fetch_add(Lap(&phaseStart), std::memory_order_relaxed);
+
+    // Local boolean plane, LoadCapture() runs on several threads at once.
+    std::vector<uint8_t> booleanFrame(indexed.size());
+    ConvertToBoolean(rgb.data(), booleanFrame.data(), (uint32_t)indexed.size());
+
+    std::vector<uint64_t> care;
+    PackCareMask(hash, &care);
+    PackRegion(booleanFrame.data(), hash, 1, care, &capture.booleanBits);
+    PackRegion(indexed.data(), hash, 4, care, &capture.indexedBits);
+
+    for (size_t i = 0; i < booleanFrame.size(); i++) booleanFrame[i] = ToRGB565(&rgb[i * 3]) != 0;
+    PackRegion(booleanFrame.data(), hash, 1, care, &capture.boolean565Bits);
+    if (capture.boolean565Bits == capture.booleanBits) capture.boolean565Bits.clear();
+    hash.booleanBits = capture.booleanBits;
+    hash.indexedBits = capture.indexedBits;
+    hash.boolean565Bits = capture.boolean565Bits;
+
+    CalculateHash(rgb.data(), &hash);
+    CalculateHashPacked(&hash);
+    m_counters.loadHashTime.fetch_add(Lap(&phaseStart), std::memory_order_relaxed);
+
+    *pCapture = std::move(capture);
+    return true;
+  }
+
+  return false;
+}
+
+// On-disk layout of PUPDMD_INDEX_FILE_NAME. All values are stored in host byte order, the magic rejects files
+// written on a machine with a different byte order.
+#pragma pack(push, 1)
+struct IndexHeader
+{
+  char magic[4];                 // "PIDX"
+  uint32_t byteOrder;            // 0x01020304
+  char version[16];              // PUPDMD_VERSION of the writer
+  uint64_t quantizationHash;     // komihash of the quantization table used for indexed hashes
+  uint8_t bitDepth;              // bitDepth passed to Load()
+  uint8_t format;                // s_indexFormat of the writer
+  uint8_t reserved[2];
+  uint32_t fileCount;            // number of IndexFile records
+  uint32_t triggerCount;         // number of IndexTrigger records
+  uint32_t namesSize;            // size of the file name blob following the trigger records
+  uint32_t careMasksSize;        // size of the care mask blob following the file names
+  uint32_t bitsSize;             // size of the packed pixel blob, see IndexBitsOffset()
+};
+
+struct IndexFile
+{
+  uint64_t size;                 // file size of the capture
+  int64_t mtime;                 // last write time of the capture
+  uint32_t nameOffset;           // offset of the file name in the name blob
+  uint32_t nameLength;           // length of the file name
+};
+
+struct IndexTrigger
+{
+  uint64_t exactColorHash;
+  uint64_t booleanHash;
+  uint64_t indexedHash;
+  uint64_t rgb565Hash;
+  uint64_t boolean565Hash;
+  uint64_t exactColorPrefixHash;
+  uint64_t booleanPrefixHash;
+  uint64_t indexedPrefixHash;
+  uint64_t rgb565PrefixHash;
+  uint64_t boolean565PrefixHash;
+  uint16_t triggerID;
+  uint16_t width;
+  uint16_t height;
+  uint8_t mask;
+  uint16_t maskX;
+  uint16_t maskY;
+  uint16_t maskWidth;
+  uint16_t maskHeight;
+  uint32_t careMaskOffset;       // offset of Hash::careMask in the care mask blob
+  uint32_t careMaskSize;         // size of Hash::careMask, 0 for a plain rectangle
+  uint32_t bitsOffset;           // offset of Hash::booleanBits followed by Hash::indexedBits in the pixel blob
+  uint8_t boolean565Bits;        // 1 if Hash::boolean565Bits follows Hash::indexedBits
+};
+#pragma pack(pop)
+
+static constexpr uint32_t s_indexByteOrder = 0x01020304;
+// Bumped whenever the layout changes without a version change, older index files are rebuilt.
+static constexpr uint8_t s_indexFormat = 7;
+
+// Offset of the packed pixel blob. The matcher reads its words in place, so it starts at a multiple of 8 bytes.
+static size_t IndexBitsOffset(const IndexHeader& header)
+{
+  const size_t offset = sizeof(IndexHeader) + (size_t)header.fileCount * sizeof(IndexFile) +
+                        (size_t)header.triggerCount * sizeof(IndexTrigger) + header.namesSize + header.careMasksSize;
+  return (offset + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+static void FillIndexHeader(IndexHeader* pHeader, uint8_t bitDepth, const uint8_t* pQuantization)
+{
+  memset(pHeader, 0, sizeof(IndexHeader));
+  memcpy(pHeader->magic, "PIDX", 4);
+  pHeader->byteOrder = s_indexByteOrder;
+  strncpy(pHeader->version, PUPDMD_VERSION, sizeof(pHeader->version) - 1);
+  pHeader->quantizationHash = komihash(pQuantization, 256, 0);
+  pHeader->bitDepth = bitDepth;
+  pHeader->format = s_indexFormat;
+}
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+ public:
+  explicit MappedFile(const std::string& path)
+  {
+#ifdef _WIN32
+    m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                         nullptr);
+    if (m_file == INVALID_HANDLE_VALUE) return;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0) return;
+    m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping) return;
+    m_pData = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (m_pData) m_size = (size_t)size.QuadPart;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+      void* pData = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (pData != MAP_FAILED)
+      {
+        m_pData = (const uint8_t*)pData;
+        m_size = (size_t)st.st_size;
+      }
+    }
+    close(fd);
+#endif
+  }
+
+  ~MappedFile()
+  {
+#ifdef _WIN32
+    if (m_pData) UnmapViewOfFile(m_pData);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+#else
+    if (m_pData) munmap((void*)m_pData, m_size);
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const uint8_t* Data() const { return m_pData; }
+  size_t Size() const { return m_size; }
+
+ private:
+  const uint8_t* m_pData = nullptr;
+  size_t m_size = 0;
+#ifdef _WIN32
+  HANDLE m_file = INVALID_HANDLE_VALUE;
+  HANDLE m_mapping = nullptr;
+#endif
+};
+
+bool DMD::ReadIndexFile(const std::string& indexPath, const std::vector<CaptureFile>& files, uint8_t bitDepth,
+                        const uint8_t* pQuantization, CaptureData* pData)
+{
+  // The mapping stays open as long as any of its captures is in use, their spans point into it.
+  auto pMapped = std::make_shared<const MappedFile>(indexPath);
+  const MappedFile& mapped = *pMapped;
+  if (!mapped.Data() || mapped.Size() < sizeof(IndexHeader)) return false;
+
+  IndexHeader expected;
+  FillIndexHeader(&expected, bitDepth, pQuantization);
+
+  const IndexHeader* pHeader = (const IndexHeader*)mapped.Data();
+  if (memcmp(pHeader, &expected, offsetof(IndexHeader, fileCount)) != 0 || pHeader->fileCount != files.size())
+  {
+    Log("Index file is outdated: %s", indexPath.c_str());
+    return false;
+  }
+
+  if (IndexBitsOffset(*pHeader) + pHeader->bitsSize != mapped.Size())
+  {
+    Log("Index file is corrupt: %s", indexPath.c_str());
+    return false;
+  }
+
+  const IndexFile* pFiles = (const IndexFile*)(mapped.Data() + sizeof(IndexHeader));
+  const IndexTrigger* pTriggerRecords = (const IndexTrigger*)(pFiles + pHeader->fileCount);
+  const char* pNames = (const char*)(pTriggerRecords + pHeader->triggerCount);
+  const uint8_t* pCareMasks = (const uint8_t*)(pNames + pHeader->namesSize);
+  const uint64_t* pBits = (const uint64_t*)(mapped.Data() + IndexBitsOffset(*pHeader));
+
+  // Any added, removed, resized or touched capture invalidates the whole index.
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    const IndexFile& file = pFiles[i];
+    if ((size_t)file.nameOffset + file.nameLength > pHeader->namesSize || file.size != files[i].size ||
+        file.mtime != files[i].mtime || files[i].fileName.compare(0, std::string::npos, pNames + file.nameOffset,
+                                                                  file.nameLength) != 0)
+    {
+      Log("Index file is outdated: %s", indexPath.c_str());
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < pHeader->triggerCount; i++)
+  {
+    const IndexTrigger& record = pTriggerRecords[i];
+    // One boolean and four indexed bitplanes per row.
+    const size_t planeWords = (size_t)RowWords(record.maskWidth) * record.maskHeight;
+    // The match kernels trust the sizes like the ones of LoadCapture(), so they get the same limits. DetectMask()
+    // never produces an empty mask box, a capture without a mask has the whole frame as its box.
+    if (record.width == 0 || record.width > PUPDMD_MAX_WIDTH || record.height == 0 ||
+        record.height > PUPDMD_MAX_HEIGHT || record.mask > 1 || record.maskWidth == 0 || record.maskHeight == 0 ||
+        (uint32_t)record.maskX + record.maskWidth > record.width ||
+        (uint32_t)record.maskY + record.maskHeight > record.height ||
+        (size_t)record.careMaskOffset + record.careMaskSize > pHeader->careMasksSize ||
+        (record.careMaskSize && record.careMaskSize != ((size_t)record.maskWidth * record.maskHeight + 7) / 8) ||
+        record.boolean565Bits > 1 || record.bitsOffset % sizeof(uint64_t) ||
+        (size_t)record.bitsOffset + planeWords * (5 + record.boolean565Bits) * sizeof(uint64_t) > pHeader->bitsSize)
+    {
+      Log("Index file is corrupt: %s", indexPath.c_str());
+      pData->triggers.clear();
+      return false;
+    }
+
+    StoredCapture& stored = pData->triggers[record.triggerID];
+    stored.storage = pMapped;
+    Hash& hash = stored.hash;
+    hash.width = record.width;
+    hash.height = record.height;
+    hash.exactColorHash = record.exactColorHash;
+    hash.booleanHash = record.booleanHash;
+    hash.indexedHash = record.indexedHash;
+    hash.rgb565Hash = record.rgb565Hash;
+    hash.boolean565Hash = record.boolean565Hash;
+    hash.exactColorPrefixHash = record.exactColorPrefixHash;
+    hash.booleanPrefixHash = record.booleanPrefixHash;
+    hash.indexedPrefixHash = record.indexedPrefixHash;
+    hash.rgb565PrefixHash = record.rgb565PrefixHash;
+    hash.boolean565PrefixHash = record.boolean565PrefixHash;
+    hash.mask = record.mask;
+    hash.maskX = record.maskX;
+    hash.maskY = record.maskY;
+    hash.maskWidth = record.maskWidth;
+    hash.maskHeight = record.maskHeight;
+    // Care masks and bits are used in place, the index is never copied.
+    const uint64_t* pRecordBits = pBits + record.bitsOffset / sizeof(uint64_t);
+    hash.careMask = {pCareMasks + record.careMaskOffset, record.careMaskSize};
+    hash.booleanBits = {pRecordBits, planeWords};
+    hash.indexedBits = {pRecordBits + planeWords, planeWords * 4};
+    if (record.boolean565Bits) hash.boolean565Bits = {pRecordBits + planeWords * 5, planeWords};
+  }
+
+  return true;
+}
+
+void DMD::WriteIndexFile(const std::string& indexPath, const std::vector<CaptureFile>& files, uint8_t bitDepth,
+                         const uint8_t* pQuantization, const CaptureData& data)
+{
+  IndexHeader header;
+  FillIndexHeader(&header, bitDepth, pQuantization);
+  header.fileCount = (uint32_t)files.size();
+  header.triggerCount = (uint32_t)data.triggers.size();
+
+  std::string names;
+  std::vector<IndexFile> fileRecords;
+  fileRecords.reserve(files.size());
+  for (const auto& file : files)
+  {
+    IndexFile record;
+    record.size = file.size;
+    record.mtime = file.mtime;
+    record.nameOffset = (uint32_t)names.size();
+    record.nameLength = (uint32_t)file.fileName.size();
+    fileRecords.push_back(record);
+    names += file.fileName;
+  }
+  header.namesSize = (uint32_t)names.size();
+
+  std::vector<uint8_t> careMasks;
+  std::vector<uint64_t> bits;
+  std::vector<IndexTrigger> triggerRecords;
+  triggerRecords.reserve(data.triggers.size());
+  for (const auto& [triggerID, stored] : data.triggers)
+  {
+    const Hash& hash = stored.hash;
+    IndexTrigger record;
+    memset(&record, 0, sizeof(IndexTrigger));
+    record.exactColorHash = hash.exactColorHash;
+    record.booleanHash = hash.booleanHash;
+    record.indexedHash = hash.indexedHash;
+    record.rgb565Hash = hash.rgb565Hash;
+    record.boolean565Hash = hash.boolean565Hash;
+    record.exactColorPrefixHash = hash.exactColorPrefixHash;
+    record.booleanPrefixHash = hash.booleanPrefixHash;
+    record.indexedPrefixHash = hash.indexedPrefixHash;
+    record.rgb565PrefixHash = hash.rgb565PrefixHash;
+    record.boolean565PrefixHash = hash.boolean565PrefixHash;
+    record.triggerID = triggerID;
+    record.width = hash.width;
+    record.height = hash.height;
+    record.mask = hash.mask;
+    record.maskX = hash.maskX;
+    record.maskY = hash.maskY;
+    record.maskWidth = hash.maskWidth;
+    record.maskHeight = hash.maskHeight;
+    record.careMaskOffset = (uint32_t)careMasks.size();
+    record.careMaskSize = (uint32_t)hash.careMask.size();
+    careMasks.insert(careMasks.end(), hash.careMask.begin(), hash.careMask.end());
+    record.bitsOffset = (uint32_t)(bits.size() * sizeof(uint64_t));
+    bits.insert(bits.end(), hash.booleanBits.begin(), hash.booleanBits.end());
+    bits.insert(bits.end(), hash.indexedBits.begin(), hash.indexedBits.end());
+    bits.insert(bits.end(), hash.boolean565Bits.begin(), hash.boolean565Bits.end());
+    record.boolean565Bits = !hash.boolean565Bits.empty();
+    triggerRecords.push_back(record);
+  }
+  header.careMasksSize = (uint32_t)careMasks.size();
+  header.bitsSize = (uint32_t)(bits.size() * sizeof(uint64_t));
+
+  // Write to a temporary file first, so a concurrent Load() never maps a half written index.
+  std::string tempPath = indexPath + ".tmp";
+  {
+    std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+    {
+      Log("Unable to write index file: %s", indexPath.c_str());
+      return;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(IndexHeader));
+    file.write(reinterpret_cast<const char*>(fileRecords.data()), fileRecords.size() * sizeof(IndexFile));
+    file.write(reinterpret_cast<const char*>(triggerRecords.data()), triggerRecords.size() * sizeof(IndexTrigger));
+    file.write(names.data(), names.size());
+    file.write(reinterpret_cast<const char*>(careMasks.data()), careMasks.size());
+    const uint64_t padding = 0;
+    file.write(reinterpret_cast<const char*>(&padding), IndexBitsOffset(header) - (size_t)file.tellp());
+    file.write(reinterpret_cast<const char*>(bits.data()), bits.size() * sizeof(uint64_t));
+    if (!file.good())
+    {
+      Log("Unable to write index file: %s", indexPath.c_str());
+      file.close();
+      std::error_code ec;
+      fs::remove(tempPath, ec);
+      return;
+    }
+  }
+
+  std::error_code ec;
+  fs::rename(tempPath, indexPath, ec);
+  if (ec)
+  {
+    Log("Unable to write index file: %s", indexPath.c_str());
+    fs::remove(tempPath, ec);
+  }
+}
+
+TriggerView DMD::GetTriggers()
+{
+  std::lock_guard<std::mutex> lock(m_writeMutex);
+  return TriggerView(m_table);
+}
+
+uint16_t DMD::Match(const uint8_t* pFrame, uint16_t width, uint16_t height, bool exactColor)
+{
+  return m_pDefaultSession->Match(pFrame, width, height, exactColor);
+}
+
+uint16_t DMD::MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height)
+{
+  return m_pDefaultSession->MatchIndexed(pFrame, width, height);
+}
+
+uint16_t DMD::MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height, IndexedLayout layout)
+{
+  return m_pDefaultSession->MatchIndexed(pFrame, width, height, layout);
+}
+
+uint16_t DMD::MatchRGB565(const uint16_t* pFrame, uint16_t width, uint16_t height, bool exactColor)
+{
+  return m_pDefaultSession->MatchRGB565(pFrame, width, height, exactColor);
+}
+
+uint16_t DMD::MatchPalette(const uint8_t* pFrame, const uint8_t* pPalette, uint16_t paletteSize, uint16_t width,
+                           uint16_t height, bool exactColor)
+{
+  return m_pDefaultSession->MatchPalette(pFrame, pPalette, paletteSize, width, height, exactColor);
+}
+
+MatchResult DMD::MatchAll(const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width, uint16_t height)
+{
+  return m_pDefaultSession->MatchAll(pFrame, pIndexedFrame, width, height);
+}
+
+void DMD::MatchBatch(const uint8_t* pFrames, uint32_t frameCount, uint16_t width, uint16_t height, MatchMode mode,
+                     uint16_t* pTriggerIDs, uint8_t threads)
+{
+  m_pDefaultSession->MatchBatch(pFrames, frameCount, width, height, mode, pTriggerIDs, threads);
+}
+
+uint16_t MatchSession::Match(const uint8_t* pFrame, uint16_t width, uint16_t height, bool exactColor)
+{
+  return m_pDMD->MatchFrame(this, pFrame, width, height, exactColor ? MatchMode::ExactColor : MatchMode::Boolean,
+                            FrameFormat());
+}
+
+uint16_t MatchSession::MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height)
+{
+  return m_pDMD->MatchFrame(this, pFrame, width, height, MatchMode::Indexed, FrameFormat());
+}
+
+uint16_t MatchSession::MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height, IndexedLayout layout)
+{
+  // Rows of the packed layouts start at a byte.
+  if (layout != IndexedLayout::Bytes && width % 8)
+  {
+    if (!m_loggedPackedWidth)
+    {
+      m_loggedPackedWidth = true;
+      m_pDMD->Log("Packed indexed frames need a width that is a multiple of 8, got %dx%d", width, height);
+    }
+    return 0;
+  }
+
+  FrameFormat format;
+  format.layout = layout;
+  return m_pDMD->MatchFrame(this, pFrame, width, height, MatchMode::Indexed, format);
+}
+
+uint16_t MatchSession::MatchRGB565(const uint16_t* pFrame, uint16_t width, uint16_t height, bool exactColor)
+{
+  FrameFormat format;
+  format.color = ColorFormat::RGB565;
+  return m_pDMD->MatchFrame(this, (const uint8_t*)pFrame, width, height,
+                            exactColor ? MatchMode::ExactColor : MatchMode::Boolean, format);
+}
+
+uint16_t MatchSession::MatchPalette(const uint8_t* pFrame, const uint8_t* pPalette, uint16_t paletteSize,
+                                    uint16_t width, uint16_t height, bool exactColor)
+{
+  FrameFormat format;
+  format.color = ColorFormat::Palette;
+  format.pPalette = pPalette;
+  format.paletteSize = std::min<uint16_t>(paletteSize, 256);
+  return m_pDMD->MatchFrame(this, pFrame, width, height, exactColor ? MatchMode::ExactColor : MatchMode::Boolean,
+                            format);
+}
+
+MatchResult MatchSession::MatchAll(const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width, uint16_t height)
+{
+  return m_pDMD->MatchAll(this, pFrame, pIndexedFrame, width, height);
+}
+
+void MatchSession::MatchBatch(const uint8_t* pFrames, uint32_t frameCount, uint16_t width, uint16_t height,
+                              MatchMode mode, uint16_t* pTriggerIDs, uint8_t threads)
+{
+  m_pDMD->MatchBatch(this, pFrames, frameCount, width, height, mode, pTriggerIDs, threads);
+}
+
+MatchSession::FrameCache* MatchSession::GetFrameCache(uint16_t width, uint16_t height, MatchMode mode,
+                                                      const FrameFormat& format)
+{
+  // Indexed frames have no color format, color frames no indexed layout.
+  const ColorFormat color = mode == MatchMode::Indexed ? ColorFormat::RGB24 : format.color;
+  const IndexedLayout layout = mode == MatchMode::Indexed ? format.layout : IndexedLayout::Bytes;
+  for (auto& cache : m_frameCaches)
+  {
+    if (cache.width == width && cache.height == height && cache.mode == mode && cache.color == color &&
+        cache.layout == layout)
+    {
+      return &cache;
+    }
+  }
+
+  // First frame of this resolution and mode in this session.
+  PUPDMD_ALLOW_ALLOCATIONS();
+
+  FrameCache cache;
+  cache.width = width;
+  cache.height = height;
+  cache.mode = mode;
+  cache.color = color;
+  cache.layout = layout;
+  cache.frame.resize(mode == MatchMode::Indexed ? IndexedFrameSize(width, height, layout)
+                                                : ColorFrameSize(width, height, color));
+  if (color == ColorFormat::Palette) cache.palette.resize(256 * 3);
+  m_frameCaches.push_back(std::move(cache));
+
+  if (m_packedFrame.size() < PackedFrameSize(width, height)) m_packedFrame.resize(PackedFrameSize(width, height));
+  if (m_dirtyRows.size() < (size_t)height * 6) m_dirtyRows.resize((size_t)height * 6);
+
+  return &m_frameCaches.back();
+}
+
+uint64_t* MatchSession::GetPrefixSums(uint16_t width, uint16_t height)
+{
+  if (m_prefixSums.size() < PrefixSumsSize(width, height) * 3)
+  {
+    PUPDMD_ALLOW_ALLOCATIONS();
+    m_prefixSums.resize(PrefixSumsSize(width, height) * 3);
+  }
+
+  return m_prefixSums.data();
+}
+
+uint16_t DMD::MatchFrame(MatchSession* pSession, const uint8_t* pFrame, uint16_t width, uint16_t height,
+                         MatchMode mode, const FrameFormat& format)
+{
+  PUPDMD_NO_ALLOCATIONS();
+
+  const auto start = std::chrono::steady_clock::now();
+  m_counters.frames.fetch_add(1, std::memory_order_relaxed);
+
+  if (m_recording.load(std::memory_order_relaxed))
+  {
+    const bool indexed = mode == MatchMode::Indexed;
+    Record((RecordedCall)mode, indexed ? nullptr : pFrame, indexed ? pFrame : nullptr, width, height, format);
+  }
+
+  const TriggerTable* pTable = AcquireTable(pSession);
+  const Resolution* pResolution = pTable ? FindResolution(*pTable, width, height) : nullptr;
+
+  // No trigger for this resolution.
+  if (!pResolution)
+  {
+    ReleaseTable(pSession);
+    m_counters.unknownResolutionFrames.fetch_add(1, std::memory_order_relaxed);
+    RecordLatency(start);
+    return 0;
+  }
+
+  MatchSession::FrameCache* pCache = pSession->GetFrameCache(width, height, mode, format);
+  const size_t paletteSize = pCache->color == ColorFormat::Palette ? (size_t)format.paletteSize * 3 : 0;
+
+  // Emulators push the same frame many times in a row. Only a changed frame needs to be hashed again, the cached
+  // result still runs through the m_lastTriggerID check below. Of a changed frame only the regions containing a
+  // changed pixel are, the others keep their hash from the previous frame.
+  bool changed = true;
+  const uint16_t* pDirtyRows = nullptr;
+  if (pCache->generation == pTable->generation && pCache->paletteSize == format.paletteSize &&
+      (!paletteSize || memcmp(pCache->palette.data(), format.pPalette, paletteSize) == 0))
+  {
+    uint8_t bitsPerPixel;
+    uint8_t planes;
+    GetPixelLayout(mode, format, &bitsPerPixel, &planes);
+    uint16_t* pRows = &pSession->m_dirtyRows[(size_t)height * 2 * (int)mode];
+    changed = FindDirtyRows(pCache->frame.data(), pFrame, width, height, bitsPerPixel, planes, pRows);
+    pDirtyRows = pRows;
+  }
+  else if (pCache->regionHashes.size() != pResolution->regionCount)
+  {
+    PUPDMD_ALLOW_ALLOCATIONS();
+    pCache->regionHashes.resize(pResolution->regionCount);
+  }
+
+  if (!changed)
+  {
+    m_counters.unchangedFrames.fetch_add(1, std::memory_order_relaxed);
+  }
+  else
+  {
+    ScanCounts counts;
+    uint64_t* pPrefixSums =
+        pTable->hashing == RegionHashing::PrefixSum ? pSession->GetPrefixSums(width, height) : nullptr;
+    pCache->found = FindTrigger(*pTable, pFrame, width, height, mode, format, pSession->m_packedFrame.data(),
+                                pPrefixSums, pDirtyRows, pCache->regionHashes.data(), &pCache->triggerID, &counts);
+    memcpy(pCache->frame.data(), pFrame, pCache->frame.size());
+    pCache->paletteSize = format.paletteSize;
+    if (paletteSize) memcpy(pCache->palette.data(), format.pPalette, paletteSize);
+    pCache->generation = pTable->generation;
+    CountScan(counts);
+  }
+
+  ReleaseTable(pSession);
+
+  const uint16_t triggerID = ReportTrigger(pSession, pCache->found, pCache->triggerID);
+  RecordLatency(start);
+
+  return triggerID;
+}
+
+void DMD::CountScan(const ScanCounts& counts)
+{
+  for (int i = 0; i < 3; i++)
+  {
+    if (counts.hashes[i]) m_counters.hashes[i].fetch_add(counts.hashes[i], std::memory_order_relaxed);
+  }
+  if (counts.reused) m_counters.reusedHashes.fetch_add(counts.reused, std::memory_order_relaxed);
+  m_counters.triggersScanned.fetch_add(counts.triggers, std::memory_order_relaxed);
+  if (counts.tolerant) m_counters.tolerantMatches.fetch_add(counts.tolerant, std::memory_order_relaxed);
+}
+
+void DMD::RecordLatency(std::chrono::steady_clock::time_point start)
+{
+  const uint64_t ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+  int bucket = 0;
+  while (bucket < PUPDMD_LATENCY_BUCKETS - 1 && ns >= (1024ull << bucket)) bucket++;
+  m_counters.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+Stats DMD::GetStats() const
+{
+  Stats stats;
+  stats.frames = m_counters.frames.load(std::memory_order_relaxed);
+  stats.unknownResolutionFrames = m_counters.unknownResolutionFrames.load(std::memory_order_relaxed);
+  stats.unchangedFrames = m_counters.unchangedFrames.load(std::memory_order_relaxed);
+  for (int i = 0; i < 3; i++) stats.hashes[i] = m_counters.hashes[i].load(std::memory_order_relaxed);
+  stats.reusedHashes = m_counters.reusedHashes.load(std::memory_order_relaxed);
+  stats.triggersScanned = m_counters.triggersScanned.load(std::memory_order_relaxed);
+  stats.matches = m_counters.matches.load(std::memory_order_relaxed);
+  stats.tolerantMatches = m_counters.tolerantMatches.load(std::memory_order_relaxed);
+  stats.suppressedMatches = m_counters.suppressedMatches.load(std::memory_order_relaxed);
+  stats.replacedFrames = m_counters.replacedFrames.load(std::memory_order_relaxed);
+  stats.loadScanTime = m_counters.loadScanTime.load(std::memory_order_relaxed);
+  stats.loadReadTime = m_counters.loadReadTime.load(std::memory_order_relaxed);
+  stats.loadDecodeTime = m_counters.loadDecodeTime.load(std::memory_order_relaxed);
+  stats.loadHashTime = m_counters.loadHashTime.load(std::memory_order_relaxed);
+  stats.loadIndexTime = m_counters.loadIndexTime.load(std::memory_order_relaxed);
+  for (int i = 0; i < PUPDMD_LATENCY_BUCKETS; i++)
+    stats.latency[i] = m_counters.latency[i].load(std::memory_order_relaxed);
+
+  return stats;
+}
+
+void DMD::ResetStats()
+{
+  m_counters.frames.store(0, std::memory_order_relaxed);
+  m_counters.unknownResolutionFrames.store(0, std::memory_order_relaxed);
+  m_counters.unchangedFrames.store(0, std::memory_order_relaxed);
+  for (auto& counter : m_counters.hashes) counter.store(0, std::memory_order_relaxed);
+  m_counters.reusedHashes.store(0, std::memory_order_relaxed);
+  m_counters.triggersScanned.store(0, std::memory_order_relaxed);
+  m_counters.matches.store(0, std::memory_order_relaxed);
+  m_counters.tolerantMatches.store(0, std::memory_order_relaxed);
+  m_counters.suppressedMatches.store(0, std::memory_order_relaxed);
+  m_counters.replacedFrames.store(0, std::memory_order_relaxed);
+  m_counters.loadScanTime.store(0, std::memory_order_relaxed);
+  m_counters.loadReadTime.store(0, std::memory_order_relaxed);
+  m_counters.loadDecodeTime.store(0, std::memory_order_relaxed);
+  m_counters.loadHashTime.store(0, std::memory_order_relaxed);
+  m_counters.loadIndexTime.store(0, std::memory_order_relaxed);
+  for (auto& counter : m_counters.latency) counter.store(0, std::memory_order_relaxed);
+}
+
+uint16_t DMD::ReportTrigger(MatchSession* pSession, bool found, uint16_t triggerID)
+{
+  if (!found) return 0;
+
+  m_counters.matches.fetch_add(1, std::memory_order_relaxed);
+  if (triggerID == pSession->m_lastTriggerID)
+  {
+    m_counters.suppressedMatches.fetch_add(1, std::memory_order_relaxed);
+    return 0;
+  }
+
+  pSession->m_lastTriggerID = triggerID;
+  Log("Matched PUP DMD trigger ID: %d", triggerID);
+  return triggerID;
+}
+
+MatchResult DMD::MatchAll(MatchSession* pSession, const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width,
+                          uint16_t height)
+{
+  PUPDMD_NO_ALLOCATIONS();
+
+  const MatchMode modes[3] = {MatchMode::ExactColor, MatchMode::Boolean, MatchMode::Indexed};
+  const uint8_t* pFrames[3] = {pFrame, pFrame, pIndexedFrame};
+  MatchSession::FrameCache* pCaches[3] = {nullptr, nullptr, nullptr};
+  bool pending[3] = {false, false, false};
+  const uint16_t* pDirtyRows[3] = {nullptr, nullptr, nullptr};
+  uint64_t* pRegionHashes[3] = {nullptr, nullptr, nullptr};
+  bool found[3] = {false, false, false};
+  uint16_t triggerIDs[3] = {0, 0, 0};
+  bool any = false;
+
+  const auto start = std::chrono::steady_clock::now();
+  if (m_recording.load(std::memory_order_relaxed))
+  {
+    Record(RecordedCall::All, pFrame, pIndexedFrame, width, height, FrameFormat());
+  }
+
+  const TriggerTable* pTable = AcquireTable(pSession);
+  const Resolution* pResolution = pTable ? FindResolution(*pTable, width, height) : nullptr;
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (!pFrames[i]) continue;
+
+    m_counters.frames.fetch_add(1, std::memory_order_relaxed);
+    if (!pResolution)
+    {
+      m_counters.unknownResolutionFrames.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    pCaches[i] = pSession->GetFrameCache(width, height, modes[i], FrameFormat());
+    bool changed = true;
+    if (pCaches[i]->generation == pTable->generation)
+    {
+      uint16_t* pRows = &pSession->m_dirtyRows[(size_t)height * 2 * i];
+      changed = FindDirtyRows(pCaches[i]->frame.data(), pFrames[i], width, height, i == 2 ? 8 : 24, 1, pRows);
+      pDirtyRows[i] = pRows;
+    }
+    else if (pCaches[i]->regionHashes.size() != pResolution->regionCount)
+    {
+      PUPDMD_ALLOW_ALLOCATIONS();
+      pCaches[i]->regionHashes.resize(pResolution->regionCount);
+    }
+
+    if (!changed)
+    {
+      m_counters.unchangedFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+      pending[i] = true;
+      pRegionHashes[i] = pCaches[i]->regionHashes.data();
+      any = true;
+    }
+  }
+
+  if (any)
+  {
+    ScanCounts counts;
+    uint64_t* pPrefixSums =
+        pTable->hashing == RegionHashing::PrefixSum ? pSession->GetPrefixSums(width, height) : nullptr;
+    FindTriggers(*pTable, pFrame, pIndexedFrame, width, height, pending, pSession->m_packedFrame.data(), pPrefixSums,
+                 pDirtyRows, pRegionHashes, found, triggerIDs, &counts);
+    CountScan(counts);
+  }
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (!pending[i]) continue;
+
+    pCaches[i]->found = found[i];
+    pCaches[i]->triggerID = triggerIDs[i];
+    memcpy(pCaches[i]->frame.data(), pFrames[i], pCaches[i]->frame.size());
+    pCaches[i]->generation = pTable->generation;
+  }
+
+  ReleaseTable(pSession);
+
+  MatchResult result;
+  uint16_t* pResults[3] = {&result.exactColorTriggerID, &result.booleanTriggerID, &result.indexedTriggerID};
+  for (int i = 0; i < 3; i++)
+  {
+    if (pCaches[i]) *pResults[i] = ReportTrigger(pSession, pCaches[i]->found, pCaches[i]->triggerID);
+  }
+
+  RecordLatency(start);
+
+  return result;
+}
+
+void DMD::MatchBatch(MatchSession* pSession, const uint8_t* pFrames, uint32_t frameCount, uint16_t width,
+                     uint16_t height, MatchMode mode, uint16_t* pTriggerIDs, uint8_t threads)
+{
+  const size_t frameSize = (size_t)width * height * (mode == MatchMode::Indexed ? 1 : 3);
+  std::vector<uint8_t> found(frameCount, 0);
+
+  if (m_recording.load(std::memory_order_relaxed))
+  {
+    for (uint32_t i = 0; i < frameCount; i++)
+    {
+      const uint8_t* pFrame = &pFrames[i * frameSize];
+      Record((RecordedCall)mode, mode == MatchMode::Indexed ? nullptr : pFrame,
+             mode == MatchMode::Indexed ? pFrame : nullptr, width, height, FrameFormat());
+    }
+  }
+
+  // The session keeps the table alive until all workers are joined.
+  const TriggerTable* pTable = AcquireTable(pSession);
+
+  unsigned int threadCount = threads ? threads : std::thread::hardware_concurrency();
+  threadCount = std::max(1u, std::min<unsigned int>(threadCount, frameCount));
+  const uint32_t chunk = (frameCount + threadCount - 1) / threadCount;
+
+  // Every thread resolves a contiguous range of frames to the trigger they match, without the m_lastTriggerID check.
+  auto worker = [&](uint32_t begin, uint32_t end)
+  {
+    ScanCounts counts;
+    std::vector<uint64_t> packedFrame(PackedFrameSize(width, height));
+    std::vector<uint64_t> prefixSums(pTable->hashing == RegionHashing::PrefixSum ? PrefixSumsSize(width, height) : 0);
+    for (uint32_t i = begin; i < end; i++)
+    {
+      const uint8_t* pFrame = &pFrames[i * frameSize];
+      if (i > begin && memcmp(pFrame - frameSize, pFrame, frameSize) == 0)
+      {
+        found[i] = found[i - 1];
+        pTriggerIDs[i] = pTriggerIDs[i - 1];
+      }
+      else
+      {
+        found[i] = FindTrigger(*pTable, pFrame, width, height, mode, FrameFormat(), packedFrame.data(),
+                               prefixSums.data(), nullptr, nullptr, &pTriggerIDs[i], &counts);
+      }
+    }
+    CountScan(counts);
+  };
+
+  const bool known = pTable && FindResolution(*pTable, width, height);
+  if (known)
+  {
+    std::vector<std::thread> pool;
+    for (uint32_t begin = chunk; begin < frameCount; begin += chunk)
+    {
+      pool.emplace_back(worker, begin, std::min(begin + chunk, frameCount));
+    }
+    worker(0, std::min(chunk, frameCount));
+    for (auto& thread : pool) thread.join();
+  }
+
+  ReleaseTable(pSession);
+
+  // Apply the repeated trigger suppression in frame order.
+  m_counters.frames.fetch_add(frameCount, std::memory_order_relaxed);
+  if (!known) m_counters.unknownResolutionFrames.fetch_add(frameCount, std::memory_order_relaxed);
+  for (uint32_t i = 0; i < frameCount; i++) pTriggerIDs[i] = ReportTrigger(pSession, found[i], pTriggerIDs[i]);
+}
+
+// On-disk layout of a recording: RecordingHeader followed by one RecordingFrame with its encoded payload per call.
+// The payload is the RGB24 or RGB565 frame followed by the indexed frame, whichever of them the call had, XORed with
+// the previous payload of the same call, resolution and planes and then run length encoded.
+#pragma pack(push, 1)
+struct RecordingHeader
+{
+  char magic[4];       // "PREC"
+  uint32_t byteOrder;  // 0x01020304
+  uint32_t version;    // 3
+};
+
+struct RecordingFrame
+{
+  uint64_t timestamp;  // nanoseconds since the start of the recording
+  uint32_t size;       // size of the encoded payload
+  uint16_t width;
+  uint16_t height;
+  uint8_t call;        // RecordedCall
+  uint8_t planes;      // bit 0: RGB frame, bit 1: indexed frame, bit 2: the RGB frame is RGB565
+};
+#pragma pack(pop)
+
+static constexpr uint32_t s_recordingByteOrder = 0x01020304;
+static constexpr uint32_t s_recordingVersion = 3;
+
+// Previous payload of one call, resolution and planes combination.
+struct RecordingStream
+{
+  uint16_t width = 0;
+  uint16_t height = 0;
+  uint8_t call = 0;
+  uint8_t planes = 0;
+  std::vector<uint8_t> previous;
+};
+
+static RecordingStream* GetRecordingStream(std::vector<RecordingStream*>& streams, const RecordingFrame& frame,
+                                           size_t size)
+{
+  for (RecordingStream* pStream : streams)
+  {
+    if (pStream->width == frame.width && pStream->height == frame.height && pStream->call == frame.call &&
+        pStream->planes == frame.planes)
+      return pStream;
+  }
+
+  RecordingStream* pStream = new RecordingStream();
+  pStream->width = frame.width;
+  pStream->height = frame.height;
+  pStream->call = frame.call;
+  pStream->planes = frame.planes;
+  pStream->previous.resize(size, 0);
+  streams.push_back(pStream);
+
+  return pStream;
+}
+
+// Control byte < 0x80: (c + 1) literal bytes follow. Otherwise the next byte repeats (c & 0x7f) + 3 times.
+static void EncodeRLE(const uint8_t* pData, size_t size, std::vector<uint8_t>* pOut)
+{
+  size_t i = 0;
+  while (i < size)
+  {
+    size_t run = 1;
+    while (i + run < size && run < 130 && pData[i + run] == pData[i]) run++;
+    if (run >= 3)
+    {
+      pOut->push_back((uint8_t)(0x80 | (run - 3)));
+      pOut->push_back(pData[i]);
+      i += run;
+      continue;
+    }
+
+    const size_t start = i;
+    while (i < size && i - start < 128)
+    {
+      if (i + 2 < size && pData[i] == pData[i + 1] && pData[i] == pData[i + 2]) break;
+      i++;
+    }
+    pOut->push_back((uint8_t)(i - start - 1));
+    pOut->insert(pOut->end(), &pData[start], &pData[i]);
+  }
+}
+
+static bool DecodeRLE(const uint8_t* pData, size_t size, uint8_t* pOut, size_t outSize)
+{
+  size_t in = 0;
+  size_t out = 0;
+  while (in < size)
+  {
+    const uint8_t control = pData[in++];
+    if (control < 0x80)
+    {
+      const size_t count = control + 1;
+      if (in + count > size || out + count > outSize) return false;
+      memcpy(&pOut[out], &pData[in], count);
+      in += count;
+      out += count;
+    }
+    else
+    {
+      const size_t count = (control & 0x7f) + 3;
+      if (in >= size || out + count > outSize) return false;
+      memset(&pOut[out], pData[in++], count);
+      out += count;
+    }
+  }
+
+  return out == outSize;
+}
+
+static size_t RecordingPayloadSize(const RecordingFrame& frame)
+{
+  const size_t pixels = (size_t)frame.width * frame.height;
+  return ((frame.planes & 1) ? pixels * ((frame.planes & 4) ? 2 : 3) : 0) + ((frame.planes & 2) ? pixels : 0);
+}
+
+// Largest payload EncodeRLE() writes for size bytes: all literals, one control byte per 128 of them.
+static size_t MaxEncodedSize(size_t size) { return size + (size + 127) / 128; }
+
+// The planes have to be the ones the call passes to the match function, so that a replay never gets a nullptr or an
+// RGB565 frame where it expects something else. Sizes are limited like the ones of captures.
+static bool IsValidRecordingFrame(const RecordingFrame& frame)
+{
+  if (frame.width > PUPDMD_MAX_WIDTH || frame.height > PUPDMD_MAX_HEIGHT) return false;
+
+  switch ((RecordedCall)frame.call)
+  {
+    case RecordedCall::ExactColor:
+    case RecordedCall::Boolean:
+      if ((frame.planes & 3) != 1 || frame.planes > 7) return false;
+      break;
+    case RecordedCall::Indexed:
+      if (frame.planes != 2) return false;
+      break;
+    case RecordedCall::All:
+      // MatchAll() takes RGB24 only.
+      if (frame.planes == 0 || frame.planes > 3) return false;
+      break;
+    default:
+      return false;
+  }
+
+  return frame.size <= MaxEncodedSize(RecordingPayloadSize(frame));
+}
+
+bool DMD::StartRecording(const char* path)
+{
+  StopRecording();
+
+  std::lock_guard<std::mutex> lock(m_recordMutex);
+
+  m_pRecordFile = fopen(path, "wb");
+  if (!m_pRecordFile)
+  {
+    Log("Error creating recording: %s", path);
+    return false;
+  }
+
+  RecordingHeader header;
+  memcpy(header.magic, "PREC", 4);
+  header.byteOrder = s_recordingByteOrder;
+  header.version = s_recordingVersion;
+  fwrite(&header, sizeof(header), 1, m_pRecordFile);
+
+  m_recordStart = std::chrono::steady_clock::now();
+  m_recording.store(true, std::memory_order_release);
+  Log("Recording frames to %s", path);
+
+  return true;
+}
+
+void DMD::StopRecording()
+{
+  std::lock_guard<std::mutex> lock(m_recordMutex);
+
+  m_recording.store(false, std::memory_order_release);
+  if (m_pRecordFile)
+  {
+    fclose(m_pRecordFile);
+    m_pRecordFile = nullptr;
+  }
+
+  for (RecordingStream* pStream : m_recordStreams) delete pStream;
+  m_recordStreams.clear();
+}
+
+void DMD::Record(RecordedCall call, const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width,
+                 uint16_t height, const FrameFormat& format)
+{
+  PUPDMD_ALLOW_ALLOCATIONS();
+
+  std::lock_guard<std::mutex> lock(m_recordMutex);
+  if (!m_pRecordFile) return;
+
+  // Recordings store RGB24 or RGB565 and one index per byte. A packed or palette frame replays the same through
+  // MatchIndexed() and Match(). RGB565 frames are kept as they are: MatchRGB565() compares them against the captures
+  // converted to RGB565, which no RGB24 frame reproduces.
+  const size_t pixels = (size_t)width * height;
+  const bool rgb565 = pFrame && format.color == ColorFormat::RGB565;
+  if (pFrame && format.color == ColorFormat::Palette)
+  {
+    m_recordColor.resize(pixels * 3);
+    uint8_t palette[256 * 3];
+    FillPalette(format, palette);
+    for (size_t i = 0; i < pixels; i++) memcpy(&m_recordColor[i * 3], &palette[pFrame[i] * 3], 3);
+    pFrame = m_recordColor.data();
+  }
+  if (pIndexedFrame && format.layout != IndexedLayout::Bytes)
+  {
+    m_recordIndexed.resize(pixels);
+    UnpackIndexedFrame(pIndexedFrame, width, height, format.layout, m_recordIndexed.data());
+    pIndexedFrame = m_recordIndexed.data();
+  }
+
+  RecordingFrame frame;
+  frame.timestamp =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_recordStart).count();
+  frame.width = width;
+  frame.height = height;
+  frame.call = (uint8_t)call;
+  frame.planes = (pFrame ? 1 : 0) | (pIndexedFrame ? 2 : 0) | (rgb565 ? 4 : 0);
+
+  const size_t size = RecordingPayloadSize(frame);
+  const size_t colorSize = pFrame ? size - (pIndexedFrame ? pixels : 0) : 0;
+  RecordingStream* pStream = GetRecordingStream(m_recordStreams, frame, size);
+
+  // Consecutive frames differ in a few pixels only, the XOR leaves long runs of zeros.
+  uint8_t* pPrevious = pStream->previous.data();
+  if (pFrame)
+  {
+    for (size_t i = 0; i < colorSize; i++) pPrevious[i] ^= pFrame[i];
+    pPrevious += colorSize;
+  }
+  if (pIndexedFrame)
+  {
+    for (size_t i = 0; i < pixels; i++) pPrevious[i] ^= pIndexedFrame[i];
+  }
+
+  m_recordBuffer.clear();
+  EncodeRLE(pStream->previous.data(), size, &m_recordBuffer);
+
+  pPrevious = pStream->previous.data();
+  if (pFrame)
+  {
+    memcpy(pPrevious, pFrame, colorSize);
+    pPrevious += colorSize;
+  }
+  if (pIndexedFrame) memcpy(pPrevious, pIndexedFrame, pixels);
+
+  frame.size = (uint32_t)m_recordBuffer.size();
+  fwrite(&frame, sizeof(frame), 1, m_pRecordFile);
+  fwrite(m_recordBuffer.data(), 1, m_recordBuffer.size(), m_pRecordFile);
+}
+
+RecordingReader::RecordingReader() {}
+
+RecordingReader::~RecordingReader() { Close(); }
+
+bool RecordingReader::Open(const char* path)
+{
+  Close();
+
+  m_pFile = fopen(path, "rb");
+  if (!m_pFile) return false;
+
+  RecordingHeader header;
+  if (fread(&header, sizeof(header), 1, m_pFile) != 1 || memcmp(header.magic, "PREC", 4) != 0 ||
+      header.byteOrder != s_recordingByteOrder || header.version != s_recordingVersion)
+  {
+    Close();
+    return false;
+  }
+
+  return true;
+}
+
+void RecordingReader::Close()
+{
+  if (m_pFile)
+  {
+    fclose(m_pFile);
+    m_pFile = nullptr;
+  }
+
+  for (RecordingStream* pStream : m_streams) delete pStream;
+  m_streams.clear();
+}
+
+bool RecordingReader::Next(RecordedFrame* pFrame)
+{
+  if (!m_pFile) return false;
+
+  RecordingFrame frame;
+  if (fread(&frame, sizeof(frame), 1, m_pFile) != 1) return false;
+  if (!IsValidRecordingFrame(frame)) return false;
+
+  m_encoded.resize(frame.size);
+  if (frame.size && fread(m_encoded.data(), 1, frame.size, m_pFile) != frame.size) return false;
+
+  const size_t size = RecordingPayloadSize(frame);
+  RecordingStream* pStream = GetRecordingStream(m_streams, frame, size);
+
+  // Decode the XOR delta, then apply it to the previous payload.
+  m_delta.resize(size);
+  if (!DecodeRLE(m_encoded.data(), m_encoded.size(), m_delta.data(), size)) return false;
+  for (size_t i = 0; i < size; i++) pStream->previous[i] ^= m_delta[i];
+
+  pFrame->timestamp = frame.timestamp;
+  pFrame->width = frame.width;
+  pFrame->height = frame.height;
+  pFrame->call = (RecordedCall)frame.call;
+  pFrame->color = (frame.planes & 4) ? ColorFormat::RGB565 : ColorFormat::RGB24;
+  pFrame->pFrame = (frame.planes & 1) ? pStream->previous.data() : nullptr;
+  // The indexed frame is the end of the payload.
+  pFrame->pIndexedFrame = (frame.planes & 2) ? pStream->previous.data() + size - (size_t)frame.width * frame.height
+                                             : nullptr;
+
+  return true;
+}
+
+bool DMD::StartAsync(PUPDMD_TriggerCallback callback, const void* userData, uint16_t width, uint16_t height)
+{
+  if (m_asyncRunning || width > PUPDMD_MAX_WIDTH || height > PUPDMD_MAX_HEIGHT) return false;
+
+  m_triggerCallback = callback;
+  m_triggerUserData = userData;
+  m_asyncHead = 0;
+  m_asyncTail = 0;
+  m_pAcquiredSlot = nullptr;
+  for (auto& slot : m_asyncSlots)
+  {
+    slot.state = AsyncSlotFree;
+    if (slot.frame.size() < (size_t)width * height * 3) slot.frame.resize((size_t)width * height * 3);
+  }
+
+  if (!m_pAsyncSession) m_pAsyncSession = CreateSession();
+
+  m_asyncRunning = true;
+  m_asyncThread = std::thread(&DMD::AsyncWorker, this);
+
+  return true;
+}
+
+void DMD::StopAsync()
+{
+  if (!m_asyncRunning) return;
+
+  m_asyncRunning = false;
+  m_asyncSignal++;
+  m_asyncSignal.notify_one();
+  m_asyncThread.join();
+}
+
+uint8_t* DMD::AcquireFrame(uint16_t width, uint16_t height, MatchMode mode)
+{
+  if (!m_asyncRunning || m_pAcquiredSlot) return nullptr;
+
+  if (width > PUPDMD_MAX_WIDTH || height > PUPDMD_MAX_HEIGHT) return nullptr;
+
+  AsyncSlot* pSlot = &m_asyncSlots[m_asyncHead % PUPDMD_ASYNC_SLOTS];
+  if (pSlot->state.load(std::memory_order_acquire) == AsyncSlotFree)
+  {
+    m_acquiredSlotIsNew = true;
+  }
+  else
+  {
+    // The ring is full. Overwrite the newest queued frame instead of waiting for the worker. If the worker already
+    // took that one, it has drained all older slots, so the slot at the head is free again.
+    AsyncSlot* pNewest = &m_asyncSlots[(m_asyncHead - 1) % PUPDMD_ASYNC_SLOTS];
+    uint8_t expected = AsyncSlotReady;
+    if (pNewest->state.compare_exchange_strong(expected, AsyncSlotWriting, std::memory_order_acquire))
+    {
+      pSlot = pNewest;
+      m_acquiredSlotIsNew = false;
+      m_counters.replacedFrames.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+      m_acquiredSlotIsNew = true;
+    }
+  }
+
+  if (m_acquiredSlotIsNew) pSlot->state.store(AsyncSlotWriting, std::memory_order_relaxed);
+
+  // The producer owns the slot while it is in the writing state, a larger resolution grows its buffer once.
+  const size_t size = (size_t)width * height * (mode == MatchMode::Indexed ? 1 : 3);
+  if (pSlot->frame.size() < size) pSlot->frame.resize(size);
+
+  pSlot->width = width;
+  pSlot->height = height;
+  pSlot->mode = mode;
+  m_pAcquiredSlot = pSlot;
+
+  return pSlot->frame.data();
+}
+
+void DMD::CommitFrame()
+{
+  if (!m_pAcquiredSlot) return;
+
+  m_pAcquiredSlot->timestamp =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+  m_pAcquiredSlot->state.store(AsyncSlotReady, std::memory_order_release);
+  m_pAcquiredSlot = nullptr;
+  if (m_acquiredSlotIsNew) m_asyncHead++;
+
+  m_asyncSignal.fetch_add(1, std::memory_order_release);
+  m_asyncSignal.notify_one();
+}
+
+bool DMD::SubmitFrame(const uint8_t* pFrame, uint16_t width, uint16_t height, MatchMode mode)
+{
+  uint8_t* pBuffer = AcquireFrame(width, height, mode);
+  if (!pBuffer) return false;
+
+  memcpy(pBuffer, pFrame, (size_t)width * height * (mode == MatchMode::Indexed ? 1 : 3));
+  CommitFrame();
+
+  return true;
+}
+
+void DMD::AsyncWorker()
+{
+  while (true)
+  {
+    uint32_t signal = m_asyncSignal.load(std::memory_order_acquire);
+
+    AsyncSlot& slot = m_asyncSlots[m_asyncTail % PUPDMD_ASYNC_SLOTS];
+    uint8_t expected = AsyncSlotReady;
+    if (slot.state.compare_exchange_strong(expected, AsyncSlotReading, std::memory_order_acq_rel))
+    {
+      uint16_t triggerID =
+          MatchFrame(m_pAsyncSession, slot.frame.data(), slot.width, slot.height, slot.mode, FrameFormat());
+      uint64_t timestamp = slot.timestamp;
+      slot.state.store(AsyncSlotFree, std::memory_order_release);
+      m_asyncTail++;
+
+      if (triggerID && m_triggerCallback) (*(m_triggerCallback))(triggerID, timestamp, m_triggerUserData);
+      continue;
+    }
+
+    // Nothing queued, or the producer is still writing the next slot.
+    if (!m_asyncRunning) break;
+    m_asyncSignal.wait(signal, std::memory_order_acquire);
+  }
 }
 
 }  // namespace PUPDMD
@@ -1,8 +1,8 @@
 #pragma once
 
 #define PUPDMD_VERSION_MAJOR 0  // X Digits
-#define PUPDMD_VERSION_MINOR 4  // Max 2 Digits
-#define PUPDMD_VERSION_PATCH 1  // Max 2 Digits
+#define PUPDMD_VERSION_MINOR 5  // Max 2 Digits
+#define PUPDMD_VERSION_PATCH 0  // Max 2 Digits
 
 #define _PUPDMD_STR(x) #x
 #define PUPDMD_STR(x) _PUPDMD_STR(x)
@@ -22,16 +22,41 @@
 #define PUPDMD_MAX_NAME_SIZE 16
 #define PUPDMD_MAX_PATH_SIZE 256
 
+#define PUPDMD_INDEX_FILE_NAME "pupdmd.pupidx"
+
+// Largest capture and frame size accepted. Any resolution up to this size works, 128x16, 128x32, 192x64 and 256x64
+// have dedicated match kernels.
+#define PUPDMD_MAX_WIDTH 1024
+#define PUPDMD_MAX_HEIGHT 512
+
+#define PUPDMD_ASYNC_SLOTS 4
+
+#define PUPDMD_LATENCY_BUCKETS 16
+
 #define PUPDMD_MASK_R 253
 #define PUPDMD_MASK_G 0
 #define PUPDMD_MASK_B 253
 
 #include <inttypes.h>
 #include <stdarg.h>
+#include <stdio.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 typedef void(PUPDMDCALLBACK* PUPDMD_LogCallback)(const char* format, va_list args, const void* userData);
+// timestamp is the steady clock time in nanoseconds at which the matching frame was submitted.
+typedef void(PUPDMDCALLBACK* PUPDMD_TriggerCallback)(uint16_t triggerID, uint64_t timestamp, const void* userData);
 
 namespace PUPDMD
 {
@@ -61,16 +86,253 @@ struct BMPHeader
 
 struct Hash
 {
-  uint8_t width = 0;
-  uint8_t height = 0;
+  uint16_t width = 0;
+  uint16_t height = 0;
   uint64_t exactColorHash = 0;
   uint64_t booleanHash = 0;
   uint64_t indexedHash = 0;
+  // exactColorHash and booleanHash of the capture converted to RGB565, see DMD::MatchRGB565().
+  uint64_t rgb565Hash = 0;
+  uint64_t boolean565Hash = 0;
+  // The five hashes above as 2D polynomial hashes of the mask box, see RegionHashing::PrefixSum. Captures with a care
+  // mask are always matched by the ones above.
+  uint64_t exactColorPrefixHash = 0;
+  uint64_t booleanPrefixHash = 0;
+  uint64_t indexedPrefixHash = 0;
+  uint64_t rgb565PrefixHash = 0;
+  uint64_t boolean565PrefixHash = 0;
   bool mask = true;
-  uint8_t maskX = 255;
-  uint8_t maskY = 255;
-  uint8_t maskWidth = 0;
-  uint8_t maskHeight = 0;
+  uint16_t maskX = UINT16_MAX;
+  uint16_t maskY = UINT16_MAX;
+  uint16_t maskWidth = 0;
+  uint16_t maskHeight = 0;
+  // The spans below point into the mapped index file or the decoded BMPs of the loaded folder. They stay valid as
+  // long as the TriggerView the Hash was taken from.
+  // Pixels of the mask box that are compared, packed row by row, least significant bit first. Empty if the whole
+  // box is compared. Set for captures with several mask rectangles or with mask colored pixels inside one.
+  std::span<const uint8_t> careMask;
+  // Pixels of the mask box as bitplanes, ignored pixels are 0. Every row starts at a 64 bit word. booleanBits has
+  // one plane per row, indexedBits four, one per bit of the index. booleanHash and indexedHash are hashes of them.
+  std::span<const uint64_t> booleanBits;
+  std::span<const uint64_t> indexedBits;
+  // booleanBits of the capture converted to RGB565, which turns the darkest colors black. Empty if it equals
+  // booleanBits, which is the case for most captures.
+  std::span<const uint64_t> boolean565Bits;
+};
+
+enum class MatchMode : uint8_t
+{
+  ExactColor,
+  Boolean,
+  Indexed
+};
+
+// How the mask regions of a frame are hashed, see DMD::SetRegionHashing().
+enum class RegionHashing : uint8_t
+{
+  Komihash,  // every region is hashed on its own, the cost grows with the area of all regions
+  PrefixSum  // the frame is summed up once, then every region is hashed in constant time
+};
+
+// Layouts of indexed frames. The packed layouts are the ones PinMAME and libdmdutil produce, the first pixel of a byte
+// is in its lowest bits. The width of a packed frame must be a multiple of 8, MatchIndexed() returns 0 for any other
+// width and logs it once per session.
+enum class IndexedLayout : uint8_t
+{
+  Bytes,    // one index per byte
+  Packed2,  // 2 bit indexes, 4 pixels per byte
+  Packed4,  // 4 bit indexes, 2 pixels per byte
+  Planes2,  // 2 bitplanes of width * height / 8 bytes each, the one of index bit 0 first
+  Planes4   // 4 bitplanes
+};
+
+// Pixel formats of color frames.
+enum class ColorFormat : uint8_t
+{
+  RGB24,   // 3 bytes per pixel, red first
+  RGB565,  // one uint16_t per pixel, red in the high bits
+  Palette  // one index per byte into a palette of RGB24 colors
+};
+
+struct MatchResult
+{
+  uint16_t exactColorTriggerID = 0;
+  uint16_t booleanTriggerID = 0;
+  uint16_t indexedTriggerID = 0;
+};
+
+// Snapshot of the counters of a DMD, see DMD::GetStats().
+struct Stats
+{
+  uint64_t frames = 0;                   // frames passed to a match function
+  uint64_t unknownResolutionFrames = 0;  // frames of a resolution without any trigger
+  uint64_t unchangedFrames = 0;          // frames equal to the previous one, answered without hashing
+  uint64_t hashes[3] = {0, 0, 0};        // region hashes computed, indexed by MatchMode
+  uint64_t reusedHashes = 0;             // region hashes without a changed pixel, kept from the previous frame
+  uint64_t triggersScanned = 0;          // trigger hashes of the hashed regions, divide by frames for a per frame value
+  uint64_t matches = 0;                  // frames that matched a trigger
+  uint64_t tolerantMatches = 0;          // frames that matched a trigger only within the tolerance
+  uint64_t suppressedMatches = 0;        // matches not reported because they repeat the last trigger
+  uint64_t replacedFrames = 0;           // async frames replaced by a newer one before the worker got to them
+
+  // Load() time in nanoseconds summed over all calls. Read, decode and hash are summed over the load threads.
+  uint64_t loadScanTime = 0;    // directory scan
+  uint64_t loadReadTime = 0;    // reading BMPs or the index file
+  uint64_t loadDecodeTime = 0;  // BMP to RGB and indexed frames, mask detection
+  uint64_t loadHashTime = 0;    // capture hashes
+  uint64_t loadIndexTime = 0;   // building the trigger table
+
+  // Duration of Match(), MatchIndexed() and MatchAll() calls. Bucket 0 counts calls below 1024 ns, bucket i calls
+  // below 1024 << i ns, the last bucket everything above.
+  uint64_t latency[PUPDMD_LATENCY_BUCKETS] = {};
+};
+
+// Match call stored in a recording. The first three values are the MatchMode of Match() and MatchIndexed().
+enum class RecordedCall : uint8_t
+{
+  ExactColor,
+  Boolean,
+  Indexed,
+  All  // MatchAll(), with pFrame and/or pIndexedFrame
+};
+
+struct RecordedFrame
+{
+  uint64_t timestamp = 0;  // nanoseconds since DMD::StartRecording()
+  uint16_t width = 0;
+  uint16_t height = 0;
+  RecordedCall call = RecordedCall::ExactColor;
+  ColorFormat color = ColorFormat::RGB24;  // RGB24 or RGB565, the format of pFrame
+  const uint8_t* pFrame = nullptr;         // RGB frame, nullptr for Indexed
+  const uint8_t* pIndexedFrame = nullptr;  // indexed frame, nullptr for ExactColor and Boolean
+};
+
+struct RecordingStream;
+
+// Reads a file written by DMD::StartRecording(). Frames are delta and run length encoded against the previous frame
+// of the same call and resolution, so they have to be read in order.
+class PUPDMDAPI RecordingReader
+{
+ public:
+  RecordingReader();
+  ~RecordingReader();
+
+  bool Open(const char* path);
+  void Close();
+  // The frame data stays valid until the next call of Next() or Close(). Returns false at the end of the recording
+  // or on a corrupt frame.
+  bool Next(RecordedFrame* pFrame);
+
+ private:
+  FILE* m_pFile = nullptr;
+  std::vector<RecordingStream*> m_streams;
+  std::vector<uint8_t> m_encoded;
+  std::vector<uint8_t> m_delta;
+};
+
+struct TriggerTable;
+struct ScanCounts;
+struct FrameFormat;
+struct CaptureData;
+struct LoadedCapture;
+class DMD;
+
+// Read-only view of the triggers of one Load() snapshot, ordered by trigger ID. The view keeps its snapshot alive
+// without copying it, later calls of Load() do not change it.
+class PUPDMDAPI TriggerView
+{
+ public:
+  class Iterator
+  {
+   public:
+    Iterator(const uint16_t* pTriggerID, const Hash* const* ppHash) : m_pTriggerID(pTriggerID), m_ppHash(ppHash) {}
+
+    std::pair<uint16_t, const Hash&> operator*() const { return {*m_pTriggerID, **m_ppHash}; }
+    Iterator& operator++()
+    {
+      m_pTriggerID++;
+      m_ppHash++;
+      return *this;
+    }
+    bool operator==(const Iterator& other) const { return m_ppHash == other.m_ppHash; }
+    bool operator!=(const Iterator& other) const { return m_ppHash != other.m_ppHash; }
+
+   private:
+    const uint16_t* m_pTriggerID;
+    const Hash* const* m_ppHash;
+  };
+
+  TriggerView() = default;
+  explicit TriggerView(std::shared_ptr<const TriggerTable> table);
+
+  size_t GetCount() const;
+  Iterator begin() const;
+  Iterator end() const;
+  // nullptr if there is no trigger with this ID.
+  const Hash* Find(uint16_t triggerID) const;
+
+ private:
+  std::shared_ptr<const TriggerTable> m_table;
+};
+
+// Per-caller match state. Every thread that matches frames concurrently needs its own session, created by
+// DMD::CreateSession(). A session never blocks, even while DMD::Load() publishes a new set of triggers.
+class PUPDMDAPI MatchSession
+{
+ public:
+  uint16_t Match(const uint8_t* pFrame, uint16_t width, uint16_t height, bool exactColor = true);
+  uint16_t MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height);
+  uint16_t MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height, IndexedLayout layout);
+  uint16_t MatchRGB565(const uint16_t* pFrame, uint16_t width, uint16_t height, bool exactColor = true);
+  uint16_t MatchPalette(const uint8_t* pFrame, const uint8_t* pPalette, uint16_t paletteSize, uint16_t width,
+                        uint16_t height, bool exactColor = true);
+  MatchResult MatchAll(const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width, uint16_t height);
+  void MatchBatch(const uint8_t* pFrames, uint32_t frameCount, uint16_t width, uint16_t height, MatchMode mode,
+                  uint16_t* pTriggerIDs, uint8_t threads = 0);
+
+ private:
+  friend class DMD;
+
+  explicit MatchSession(DMD* pDMD);
+  ~MatchSession();
+
+  // Last frame seen per resolution and mode together with the trigger it matched.
+  struct FrameCache
+  {
+    uint16_t width = 0;
+    uint16_t height = 0;
+    MatchMode mode = MatchMode::ExactColor;
+    ColorFormat color = ColorFormat::RGB24;
+    IndexedLayout layout = IndexedLayout::Bytes;
+    uint64_t generation = 0;  // TriggerTable the result belongs to, 0 = none
+    bool found = false;
+    uint16_t triggerID = 0;
+    std::vector<uint8_t> frame;
+    // Palette of the last ColorFormat::Palette frame, 256 colors.
+    uint16_t paletteSize = 0;
+    std::vector<uint8_t> palette;
+    // Hash of every mask region of the resolution in frame, valid for generation.
+    std::vector<uint64_t> regionHashes;
+  };
+
+  FrameCache* GetFrameCache(uint16_t width, uint16_t height, MatchMode mode, const FrameFormat& format);
+  // m_prefixSums grown to one set per match mode of a frame.
+  uint64_t* GetPrefixSums(uint16_t width, uint16_t height);
+
+  DMD* m_pDMD;
+  // Table this session is reading, published as a hazard pointer so that Load() keeps it alive.
+  std::atomic<const TriggerTable*> m_pTable = nullptr;
+  uint16_t m_lastTriggerID = 0;
+  // A packed indexed frame of a width that is no multiple of 8 was logged.
+  bool m_loggedPackedWidth = false;
+  // Scratch storage for the packed planes of the match path so that matching does not allocate.
+  std::vector<uint64_t> m_packedFrame;
+  // First and last changed column of every row against the cached frame, one set per match mode.
+  std::vector<uint16_t> m_dirtyRows;
+  // Prefix sums of the frame for RegionHashing::PrefixSum, one set per match mode.
+  std::vector<uint64_t> m_prefixSums;
+  // A deque keeps the caches in place while MatchAll() adds the ones of another mode.
+  std::deque<FrameCache> m_frameCaches;
 };
 
 class PUPDMDAPI DMD
@@ -80,21 +342,206 @@ class PUPDMDAPI DMD
   ~DMD();
 
   void SetLogCallback(PUPDMD_LogCallback callback, const void* userData);
+  // Number of threads Load() uses to read and hash captures, 0 = one per hardware thread. Default is 1.
+  void SetLoadThreads(uint8_t threads);
+  // Load() caches the hashes of a PupCapture folder in PUPDMD_INDEX_FILE_NAME inside that folder and skips reading
+  // the BMPs as long as none of them changed. Enabled by default.
+  void SetUseIndexFile(bool useIndexFile);
+  // Captures are kept in a process wide store shared by all DMD instances. A folder that is still loaded by any DMD
+  // is only scanned for changed captures, it is read again only if a capture was added, removed or changed. Identical
+  // captures of different folders are stored once, and DMDs with the same folders and tolerance share one trigger
+  // table. Disable it to always read the folder. Enabled by default.
+  void SetShareCaptures(bool shareCaptures);
+  // Adds the captures of a PupCapture folder. Safe to call while sessions are matching: the new triggers are
+  // published as a new snapshot once they are complete. Loading a folder again replaces its triggers.
   bool Load(const char* const puppath, const char* const romname, uint8_t bitDepth = 2);
-  uint16_t Match(const uint8_t* pFrame, uint8_t width, uint8_t height, bool exactColor = true);
-  uint16_t MatchIndexed(const uint8_t* pFrame, uint8_t width, uint8_t height);
-  const std::map<uint16_t, Hash> GetHashMap() { return m_HashMap; }
+  // Overrides the red channel thresholds used by Load() to convert captures for indexed matching. Expects
+  // (1 << bitDepth) - 1 ascending values, index i is used for red < thresholds[i]. nullptr restores the default.
+  bool SetQuantizationThresholds(uint8_t bitDepth, const uint8_t* thresholds);
+  // Lets boolean and indexed matching accept a capture whose compared pixels differ from the frame in at most pixels
+  // pixels, if no capture matches exactly. The capture with the fewest differing pixels wins, ties go to the lowest
+  // trigger ID. 0 disables it, which is the default.
+  void SetTolerance(uint16_t pixels);
+  // Komihash hashes every mask region of a frame on its own. PrefixSum builds a 2D polynomial prefix sum of the
+  // frame once and derives the hash of every mask rectangle from four of its values, which pays off for PupPacks
+  // with many different mask rectangles. Regions with a care mask are hashed with komihash either way. The default is
+  // Komihash.
+  void SetRegionHashing(RegionHashing hashing);
+
+  // Sessions are owned by the DMD, remaining ones are destroyed together with it.
+  MatchSession* CreateSession();
+  void DestroySession(MatchSession* pSession);
+
+  // Match functions of the default session. They must not be called from several threads at once, use one
+  // session per thread instead.
+  uint16_t Match(const uint8_t* pFrame, uint16_t width, uint16_t height, bool exactColor = true);
+  // Indexed frames hold one 2 or 4 bit index per byte, higher bits are ignored.
+  uint16_t MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height);
+  // Matches a packed indexed frame without unpacking it, its bits are moved straight into the planes the captures are
+  // stored in. The result equals MatchIndexed() of the same frame with one index per byte.
+  uint16_t MatchIndexed(const uint8_t* pFrame, uint16_t width, uint16_t height, IndexedLayout layout);
+  // Matches a RGB565 frame. Load() converts the captures to RGB565 as well, so both modes compare them at that
+  // precision: in boolean mode a pixel is lit if it is not black in RGB565, for the frame and the capture.
+  uint16_t MatchRGB565(const uint16_t* pFrame, uint16_t width, uint16_t height, bool exactColor = true);
+  // Matches a frame of indexes into pPalette, paletteSize RGB24 colors, without expanding it. The result equals
+  // Match() of the expanded frame, indexes past the palette are black.
+  uint16_t MatchPalette(const uint8_t* pFrame, const uint8_t* pPalette, uint16_t paletteSize, uint16_t width,
+                        uint16_t height, bool exactColor = true);
+  // Matches a RGB frame in exact color and boolean mode and, if pIndexedFrame is not nullptr, its index plane in
+  // indexed mode. The boolean and indexed planes are packed once and shared by all mask regions. The result equals
+  // calling Match(pFrame, true), Match(pFrame, false) and MatchIndexed(pIndexedFrame) in this order.
+  MatchResult MatchAll(const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width, uint16_t height);
+  // Matches frameCount frames of one resolution and mode stored back to back and writes one trigger ID per frame
+  // to pTriggerIDs, exactly as calling Match()/MatchIndexed() for each frame in order would. The hashing is spread
+  // over threads, 0 = one per hardware thread.
+  void MatchBatch(const uint8_t* pFrames, uint32_t frameCount, uint16_t width, uint16_t height, MatchMode mode,
+                  uint16_t* pTriggerIDs, uint8_t threads = 0);
+  TriggerView GetTriggers();
+
+  // Asynchronous matching. Frames are handed to a worker thread through a ring of PUPDMD_ASYNC_SLOTS slots and
+  // matched triggers are reported through the callback on that thread. Submitting never blocks: if the worker falls
+  // behind, the newest queued frame is replaced. Only one thread may submit frames. The worker uses its own session.
+  // The slots are sized for RGB frames of width x height up front, a larger frame grows a slot when it is submitted.
+  bool StartAsync(PUPDMD_TriggerCallback callback, const void* userData, uint16_t width = 0, uint16_t height = 0);
+  void StopAsync();
+  bool SubmitFrame(const uint8_t* pFrame, uint16_t width, uint16_t height, MatchMode mode);
+  // Zero-copy submission: write the frame into the returned buffer, then call CommitFrame().
+  uint8_t* AcquireFrame(uint16_t width, uint16_t height, MatchMode mode);
+  void CommitFrame();
+
+  // Records every frame passed to a match function of any session to path, see RecordingReader and pupdmd_replay.
+  bool StartRecording(const char* path);
+  void StopRecording();
+
+  // Counters of all sessions. They are updated with relaxed atomics, so a snapshot taken while frames are matched
+  // is not necessarily consistent across fields.
+  Stats GetStats() const;
+  void ResetStats();
 
  private:
+  friend class MatchSession;
+
+  struct CaptureFile
+  {
+    std::string fileName;
+    std::string filePath;
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    uint16_t triggerID = 0;
+  };
+
   void Log(const char* format, ...);
-  void CalculateHash(const uint8_t* pFrame, Hash* pHash, bool exactColor);
-  void CalculateHashIndexed(const uint8_t* pFrame, Hash* pHash);
+  void AsyncWorker();
+  const TriggerTable* AcquireTable(MatchSession* pSession);
+  void ReleaseTable(MatchSession* pSession);
+  void PublishTable(std::shared_ptr<const TriggerTable> table);
+  void ReclaimTables();
+  uint16_t MatchFrame(MatchSession* pSession, const uint8_t* pFrame, uint16_t width, uint16_t height, MatchMode mode,
+                      const FrameFormat& format);
+  MatchResult MatchAll(MatchSession* pSession, const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width,
+                       uint16_t height);
+  void MatchBatch(MatchSession* pSession, const uint8_t* pFrames, uint32_t frameCount, uint16_t width,
+                  uint16_t height, MatchMode mode, uint16_t* pTriggerIDs, uint8_t threads);
+  uint16_t ReportTrigger(MatchSession* pSession, bool found, uint16_t triggerID);
+  void LoadCaptures(const std::vector<CaptureFile>& files, const uint8_t* pQuantization, CaptureData* pData);
+  bool LoadCapture(const std::string& filePath, const uint8_t* pQuantization, LoadedCapture* pCapture);
+  bool ReadIndexFile(const std::string& indexPath, const std::vector<CaptureFile>& files, uint8_t bitDepth,
+                     const uint8_t* pQuantization, CaptureData* pData);
+  void WriteIndexFile(const std::string& indexPath, const std::vector<CaptureFile>& files, uint8_t bitDepth,
+                      const uint8_t* pQuantization, const CaptureData& data);
+  const uint8_t* GetQuantizationTable(uint8_t bitDepth) const;
+  void CountScan(const ScanCounts& counts);
+  void Record(RecordedCall call, const uint8_t* pFrame, const uint8_t* pIndexedFrame, uint16_t width, uint16_t height,
+              const FrameFormat& format);
+  void RecordLatency(std::chrono::steady_clock::time_point start);
 
-  std::map<uint16_t, Hash> m_HashMap;
-  uint16_t m_lastTriggerID = 0;
+  // Current trigger snapshot. m_table owns it, m_pTable is what sessions read without taking a lock.
+  std::shared_ptr<const TriggerTable> m_table;
+  std::atomic<const TriggerTable*> m_pTable = nullptr;
+  // Serializes Load() and other writers.
+  std::mutex m_writeMutex;
+
+  std::mutex m_sessionMutex;
+  std::vector<MatchSession*> m_sessions;
+  // Tables replaced while a session might still use them, see ReclaimTables(). Guarded by m_sessionMutex.
+  std::vector<std::shared_ptr<const TriggerTable>> m_retiredTables;
+  MatchSession* m_pDefaultSession = nullptr;
+
+  std::map<uint8_t, std::array<uint8_t, 256>> m_quantizationTables;
+
+  // Backing store of Stats, the fields have the same meaning.
+  struct Counters
+  {
+    std::atomic<uint64_t> frames = 0;
+    std::atomic<uint64_t> unknownResolutionFrames = 0;
+    std::atomic<uint64_t> unchangedFrames = 0;
+    std::atomic<uint64_t> hashes[3] = {0, 0, 0};
+    std::atomic<uint64_t> reusedHashes = 0;
+    std::atomic<uint64_t> triggersScanned = 0;
+    std::atomic<uint64_t> matches = 0;
+    std::atomic<uint64_t> tolerantMatches = 0;
+    std::atomic<uint64_t> suppressedMatches = 0;
+    std::atomic<uint64_t> replacedFrames = 0;
+    std::atomic<uint64_t> loadScanTime = 0;
+    std::atomic<uint64_t> loadReadTime = 0;
+    std::atomic<uint64_t> loadDecodeTime = 0;
+    std::atomic<uint64_t> loadHashTime = 0;
+    std::atomic<uint64_t> loadIndexTime = 0;
+    std::atomic<uint64_t> latency[PUPDMD_LATENCY_BUCKETS] = {};
+  };
+
+  Counters m_counters;
+
+  enum AsyncSlotState : uint8_t
+  {
+    AsyncSlotFree,
+    AsyncSlotWriting,
+    AsyncSlotReady,
+    AsyncSlotReading
+  };
+
+  struct AsyncSlot
+  {
+    std::atomic<uint8_t> state = AsyncSlotFree;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    MatchMode mode = MatchMode::ExactColor;
+    uint64_t timestamp = 0;
+    std::vector<uint8_t> frame;
+  };
+
+  AsyncSlot m_asyncSlots[PUPDMD_ASYNC_SLOTS];
+  uint64_t m_asyncHead = 0;  // producer only
+  uint64_t m_asyncTail = 0;  // worker only
+  AsyncSlot* m_pAcquiredSlot = nullptr;
+  bool m_acquiredSlotIsNew = false;
+  std::atomic<uint32_t> m_asyncSignal = 0;
+  std::atomic<bool> m_asyncRunning = false;
+  std::thread m_asyncThread;
+  MatchSession* m_pAsyncSession = nullptr;
+  PUPDMD_TriggerCallback m_triggerCallback = nullptr;
+  const void* m_triggerUserData = nullptr;
+
+  // Recording is rare, sessions only check the flag and take the mutex while it is set.
+  std::atomic<bool> m_recording = false;
+  std::mutex m_recordMutex;
+  FILE* m_pRecordFile = nullptr;
+  std::chrono::steady_clock::time_point m_recordStart;
+  std::vector<RecordingStream*> m_recordStreams;
+  std::vector<uint8_t> m_recordBuffer;
+  // Palette frames expanded to RGB24, packed indexed frames unpacked to one index per byte.
+  std::vector<uint8_t> m_recordColor;
+  std::vector<uint8_t> m_recordIndexed;
+
+  uint16_t m_tolerance = 0;
+  RegionHashing m_regionHashing = RegionHashing::Komihash;
+  uint8_t m_loadThreads = 1;
+  bool m_useIndexFile = true;
+  bool m_shareCaptures = true;
 
   PUPDMD_LogCallback m_logCallback = nullptr;
   const void* m_logUserData = nullptr;
+  std::mutex m_logMutex;
 };
 
 }  // namespace PUPDMD
@@ -0,0 +1,157 @@
+#include <inttypes.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pupdmd.h"
+
+void PUPDMDCALLBACK LogCallback(const char* format, va_list args, const void* pUserData)
+{
+  if (!*(const bool*)pUserData) return;
+
+  char buffer[1024];
+  vsnprintf(buffer, sizeof(buffer), format, args);
+
+  fprintf(stderr, "%s\n", buffer);
+}
+
+static void PrintUsage()
+{
+  fprintf(stderr,
+          "Usage: pupdmd_replay <puppath> <romname> <recording> [--bit-depth 2|4] [--realtime] [--verbose]\n"
+          "Feeds a recording made with DMD::StartRecording() through the captures of <puppath>/<romname>/PupCapture\n"
+          "and prints the triggers and per frame timings.\n");
+}
+
+static const char* CallName(PUPDMD::RecordedCall call)
+{
+  switch (call)
+  {
+    case PUPDMD::RecordedCall::ExactColor:
+      return "exactColor";
+    case PUPDMD::RecordedCall::Boolean:
+      return "boolean";
+    case PUPDMD::RecordedCall::Indexed:
+      return "indexed";
+    default:
+      return "all";
+  }
+}
+
+int main(int argc, const char* argv[])
+{
+  if (argc < 4)
+  {
+    PrintUsage();
+    return 1;
+  }
+
+  uint8_t bitDepth = 2;
+  bool realtime = false;
+  bool verbose = false;
+  for (int i = 4; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--bit-depth") && i + 1 < argc)
+      bitDepth = (uint8_t)atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--realtime"))
+      realtime = true;
+    else if (!strcmp(argv[i], "--verbose"))
+      verbose = true;
+    else
+    {
+      PrintUsage();
+      return 1;
+    }
+  }
+
+  PUPDMD::DMD dmd;
+  dmd.SetLogCallback(LogCallback, &verbose);
+  if (!dmd.Load(argv[1], argv[2], bitDepth))
+  {
+    fprintf(stderr, "Error loading captures of %s from %s\n", argv[2], argv[1]);
+    return 1;
+  }
+
+  PUPDMD::RecordingReader reader;
+  if (!reader.Open(argv[3]))
+  {
+    fprintf(stderr, "Error opening recording %s\n", argv[3]);
+    return 1;
+  }
+
+  std::vector<uint64_t> timings;
+  uint64_t triggers = 0;
+  const auto start = std::chrono::steady_clock::now();
+
+  PUPDMD::RecordedFrame frame;
+  while (reader.Next(&frame))
+  {
+    // Real time keeps the gaps between the recorded frames, otherwise frames are matched back to back.
+    if (realtime) std::this_thread::sleep_until(start + std::chrono::nanoseconds(frame.timestamp));
+
+    uint16_t triggerIDs[3] = {0, 0, 0};
+    const auto matchStart = std::chrono::steady_clock::now();
+    switch (frame.call)
+    {
+      case PUPDMD::RecordedCall::ExactColor:
+      case PUPDMD::RecordedCall::Boolean:
+      {
+        const bool exactColor = frame.call == PUPDMD::RecordedCall::ExactColor;
+        if (frame.color == PUPDMD::ColorFormat::RGB565)
+          triggerIDs[0] = dmd.MatchRGB565((const uint16_t*)frame.pFrame, frame.width, frame.height, exactColor);
+        else
+          triggerIDs[0] = dmd.Match(frame.pFrame, frame.width, frame.height, exactColor);
+        break;
+      }
+      case PUPDMD::RecordedCall::Indexed:
+        triggerIDs[0] = dmd.MatchIndexed(frame.pIndexedFrame, frame.width, frame.height);
+        break;
+      default:
+      {
+        PUPDMD::MatchResult result = dmd.MatchAll(frame.pFrame, frame.pIndexedFrame, frame.width, frame.height);
+        triggerIDs[0] = result.exactColorTriggerID;
+        triggerIDs[1] = result.booleanTriggerID;
+        triggerIDs[2] = result.indexedTriggerID;
+        break;
+      }
+    }
+    const uint64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - matchStart).count();
+    timings.push_back(ns);
+
+    for (uint16_t triggerID : triggerIDs)
+    {
+      if (!triggerID) continue;
+
+      triggers++;
+      printf("frame %zu, %.3f ms, %dx%d %s: trigger ID %03d\n", timings.size() - 1, frame.timestamp / 1e6,
+             frame.width, frame.height, CallName(frame.call), triggerID);
+    }
+  }
+
+  if (timings.empty())
+  {
+    printf("No frames in %s\n", argv[3]);
+    return 0;
+  }
+
+  std::vector<uint64_t> sorted = timings;
+  std::sort(sorted.begin(), sorted.end());
+  uint64_t total = 0;
+  for (uint64_t ns : timings) total += ns;
+
+  const PUPDMD::Stats stats = dmd.GetStats();
+  printf("frames: %zu, triggers: %" PRIu64 ", unchanged frames: %" PRIu64 "\n", timings.size(), triggers,
+         stats.unchangedFrames);
+  printf("ns per frame: avg %" PRIu64 ", min %" PRIu64 ", p50 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64 "\n",
+         total / timings.size(), sorted.front(), sorted[sorted.size() / 2], sorted[sorted.size() * 99 / 100],
+         sorted.back());
+
+  return 0;
+}
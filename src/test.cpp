@@ -17,7 +17,7 @@ int main(int argc, const char* argv[])
   PUPDMD::DMD* pDmd = new PUPDMD::DMD();
   pDmd->SetLogCallback(LogCallback, nullptr);
   pDmd->Load(".", "test", 4);
-  for (const auto& pair : pDmd->GetHashMap())
+  for (const auto& pair : pDmd->GetTriggers())
   {
     printf("triggerID: %03d, mask: %d, x: %03d, y: %03d, width: %03d, height: %03d, exactColorHash: %020" PRIu64
            ", booleanHash: %020" PRIu64 ", indexedHash: %020" PRIu64 "\n",
@@ -0,0 +1,1092 @@
+#include <inttypes.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pupdmd.h"
+
+// Checks the match functions on generated captures, and that the match paths which promise the same result agree.
+// The library sources are compiled into this executable with PUPDMD_ALLOCATION_CHECK, so a heap allocation inside a
+// match aborts it.
+
+namespace fs = std::filesystem;
+
+static int s_failures = 0;
+
+#define CHECK(condition, ...)                                     \
+  do                                                              \
+  {                                                               \
+    if (!(condition))                                             \
+    {                                                             \
+      if (s_failures++ < 50)                                      \
+      {                                                           \
+        printf("%s:%d: check failed: ", __FILE__, __LINE__);      \
+        printf(__VA_ARGS__);                                      \
+        printf("\n");                                             \
+      }                                                           \
+    }                                                             \
+  } while (0)
+
+// Frames and captures are drawn from these colors. 1 and 2 are lit in RGB24 but black in RGB565.
+static const uint8_t s_colors[][3] = {{0, 0, 0},     {6, 3, 0},     {0, 2, 7},      {100, 50, 0},
+                                      {200, 100, 0}, {30, 200, 90}, {250, 250, 250}, {150, 20, 220}};
+static constexpr uint8_t s_colorCount = sizeof(s_colors) / sizeof(s_colors[0]);
+static constexpr uint8_t s_maskColor = 0xFF;
+
+static const uint8_t s_thresholds2[] = {8, 64, 160};
+static const uint8_t s_thresholds4[] = {8, 20, 40, 60, 80, 100, 120, 140, 160, 180, 200, 215, 230, 240, 250};
+
+struct Random
+{
+  uint64_t state = 0x9E3779B97F4A7C15ull;
+
+  uint32_t Next(uint32_t range)
+  {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)((state >> 32) % range);
+  }
+};
+
+struct Rect
+{
+  uint16_t x, y, width, height;
+};
+
+struct Capture
+{
+  uint16_t triggerID = 0;
+  uint16_t width = 0;
+  uint16_t height = 0;
+  std::vector<Rect> rects;  // mask rectangles, empty compares the whole frame
+  std::vector<uint8_t> pixels;  // color index per pixel or s_maskColor
+};
+
+// A frame as color indexes, expanded to the formats of the match functions.
+struct Frame
+{
+  uint16_t width = 0;
+  uint16_t height = 0;
+  std::vector<uint8_t> colors;
+  std::vector<uint8_t> rgb;
+  std::vector<uint16_t> rgb565;
+  std::vector<uint8_t> indexed2;
+  std::vector<uint8_t> indexed4;
+};
+
+static uint8_t Quantize(uint8_t red, const uint8_t* thresholds, uint8_t count)
+{
+  uint8_t index = 0;
+  while (index < count && red >= thresholds[index]) index++;
+  return index;
+}
+
+static Frame MakeFrame(uint16_t width, uint16_t height, std::vector<uint8_t> colors)
+{
+  Frame frame;
+  frame.width = width;
+  frame.height = height;
+  frame.colors = std::move(colors);
+  for (uint8_t color : frame.colors)
+  {
+    const uint8_t* pRGB = s_colors[color];
+    frame.rgb.insert(frame.rgb.end(), pRGB, pRGB + 3);
+    frame.rgb565.push_back((uint16_t)(((pRGB[0] >> 3) << 11) | ((pRGB[1] >> 2) << 5) | (pRGB[2] >> 3)));
+    frame.indexed2.push_back(Quantize(pRGB[0], s_thresholds2, sizeof(s_thresholds2)));
+    frame.indexed4.push_back(Quantize(pRGB[0], s_thresholds4, sizeof(s_thresholds4)));
+  }
+  return frame;
+}
+
+// Pixels of a capture that a frame has to reproduce to match it.
+static bool IsCompared(const Capture& capture, uint16_t x, uint16_t y)
+{
+  if (capture.pixels[(size_t)y * capture.width + x] == s_maskColor) return false;
+  if (capture.rects.empty()) return true;
+  for (const Rect& rect : capture.rects)
+  {
+    if (x >= rect.x && x < rect.x + rect.width && y >= rect.y && y < rect.y + rect.height) return true;
+  }
+  return false;
+}
+
+static void WriteBMP(const fs::path& path, const Capture& capture)
+{
+  const uint32_t stride = ((uint32_t)capture.width * 3 + 3) & ~3u;
+  std::vector<uint8_t> data((size_t)stride * capture.height, 0);
+  for (uint16_t y = 0; y < capture.height; y++)
+  {
+    uint8_t* pRow = &data[(size_t)(capture.height - 1 - y) * stride];
+    for (uint16_t x = 0; x < capture.width; x++)
+    {
+      const uint8_t color = capture.pixels[(size_t)y * capture.width + x];
+      const uint8_t mask[3] = {PUPDMD_MASK_R, PUPDMD_MASK_G, PUPDMD_MASK_B};
+      const uint8_t* pRGB = color == s_maskColor ? mask : s_colors[color];
+      pRow[x * 3] = pRGB[2];
+      pRow[x * 3 + 1] = pRGB[1];
+      pRow[x * 3 + 2] = pRGB[0];
+    }
+  }
+
+  PUPDMD::BMPHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, "BM", 2);
+  header.dataOffset = sizeof(header);
+  header.fileSize = header.dataOffset + (uint32_t)data.size();
+  header.headerSize = 40;
+  header.width = capture.width;
+  header.height = capture.height;
+  header.planes = 1;
+  header.bpp = 24;
+  header.imageSize = (uint32_t)data.size();
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// Captures of several resolutions, with and without mask rectangles, with care masks, and sharing mask regions.
+static std::vector<Capture> GenerateCaptures(Random& random)
+{
+  static const uint16_t s_resolutions[][2] = {{128, 32}, {128, 16}, {192, 64}, {256, 64}, {50, 10}};
+
+  std::vector<Capture> captures;
+  for (const auto& resolution : s_resolutions)
+  {
+    const uint16_t width = resolution[0];
+    const uint16_t height = resolution[1];
+    for (int kind = 0; kind < 6; kind++)
+    {
+      Capture capture;
+      capture.triggerID = (uint16_t)(captures.size() + 1);
+      capture.width = width;
+      capture.height = height;
+      capture.pixels.resize((size_t)width * height);
+      for (uint8_t& pixel : capture.pixels) pixel = (uint8_t)random.Next(s_colorCount);
+
+      // 0 and 5 compare the whole frame, 1 and 2 share a mask region, 3 has two rectangles and 4 an ignored pixel.
+      if (kind == 1 || kind == 2) capture.rects.push_back({3, 2, (uint16_t)(width / 3), (uint16_t)(height / 3)});
+      if (kind == 3)
+      {
+        capture.rects.push_back({2, 1, 9, 3});
+        capture.rects.push_back({(uint16_t)(width / 2), (uint16_t)(height / 2), 7, 3});
+      }
+      if (kind == 4) capture.rects.push_back({5, 3, (uint16_t)(width / 2), (uint16_t)(height / 2)});
+
+      for (const Rect& rect : capture.rects)
+      {
+        for (int x = rect.x - 1; x <= rect.x + rect.width; x++)
+        {
+          capture.pixels[(size_t)(rect.y - 1) * width + x] = s_maskColor;
+          capture.pixels[(size_t)(rect.y + rect.height) * width + x] = s_maskColor;
+        }
+        for (int y = rect.y - 1; y <= rect.y + rect.height; y++)
+        {
+          capture.pixels[(size_t)y * width + rect.x - 1] = s_maskColor;
+          capture.pixels[(size_t)y * width + rect.x + rect.width] = s_maskColor;
+        }
+      }
+      if (kind == 4) capture.pixels[(size_t)(4 * width) + 7] = s_maskColor;
+
+      captures.push_back(std::move(capture));
+    }
+  }
+  return captures;
+}
+
+// The frame of a capture with every pixel it does not compare randomized.
+static Frame CaptureFrame(const Capture& capture, Random& random)
+{
+  std::vector<uint8_t> colors(capture.pixels);
+  for (uint16_t y = 0; y < capture.height; y++)
+  {
+    for (uint16_t x = 0; x < capture.width; x++)
+    {
+      if (!IsCompared(capture, x, y)) colors[(size_t)y * capture.width + x] = (uint8_t)random.Next(s_colorCount);
+    }
+  }
+  return MakeFrame(capture.width, capture.height, std::move(colors));
+}
+
+// The frame of a capture with one compared pixel switched between black and lit.
+static Frame NearFrame(const Capture& capture, Random& random)
+{
+  Frame frame = CaptureFrame(capture, random);
+  std::vector<uint8_t> colors = frame.colors;
+  for (;;)
+  {
+    const uint16_t x = (uint16_t)random.Next(capture.width);
+    const uint16_t y = (uint16_t)random.Next(capture.height);
+    if (!IsCompared(capture, x, y)) continue;
+    uint8_t& color = colors[(size_t)y * capture.width + x];
+    color = color == 0 ? 6 : 0;
+    break;
+  }
+  return MakeFrame(capture.width, capture.height, std::move(colors));
+}
+
+static std::vector<uint8_t> PackIndexes(const std::vector<uint8_t>& indexes, uint8_t bits, bool planar)
+{
+  const size_t pixels = indexes.size();
+  std::vector<uint8_t> packed(pixels * bits / 8, 0);
+  for (size_t i = 0; i < pixels; i++)
+  {
+    if (planar)
+    {
+      for (uint8_t plane = 0; plane < bits; plane++)
+        packed[(plane * pixels / 8) + (i / 8)] |= ((indexes[i] >> plane) & 1) << (i % 8);
+    }
+    else
+    {
+      packed[i * bits / 8] |= indexes[i] << (i * bits % 8);
+    }
+  }
+  return packed;
+}
+
+static bool SameHash(const PUPDMD::Hash& a, const PUPDMD::Hash& b)
+{
+  return a.width == b.width && a.height == b.height && a.exactColorHash == b.exactColorHash &&
+         a.booleanHash == b.booleanHash && a.indexedHash == b.indexedHash && a.rgb565Hash == b.rgb565Hash &&
+         a.boolean565Hash == b.boolean565Hash && a.exactColorPrefixHash == b.exactColorPrefixHash &&
+         a.booleanPrefixHash == b.booleanPrefixHash && a.indexedPrefixHash == b.indexedPrefixHash &&
+         a.rgb565PrefixHash == b.rgb565PrefixHash && a.boolean565PrefixHash == b.boolean565PrefixHash &&
+         a.mask == b.mask && a.maskX == b.maskX && a.maskY == b.maskY && a.maskWidth == b.maskWidth &&
+         a.maskHeight == b.maskHeight &&
+         std::equal(a.careMask.begin(), a.careMask.end(), b.careMask.begin(), b.careMask.end()) &&
+         std::equal(a.booleanBits.begin(), a.booleanBits.end(), b.booleanBits.begin(), b.booleanBits.end()) &&
+         std::equal(a.indexedBits.begin(), a.indexedBits.end(), b.indexedBits.begin(), b.indexedBits.end()) &&
+         std::equal(a.boolean565Bits.begin(), a.boolean565Bits.end(), b.boolean565Bits.begin(),
+                    b.boolean565Bits.end());
+}
+
+// Loads the generated folder. Without shareCaptures the DMD reads it itself instead of sharing another DMD's captures.
+static void Load(PUPDMD::DMD* pDMD, const fs::path& dir, uint8_t bitDepth, bool useIndexFile,
+                 bool shareCaptures = false)
+{
+  pDMD->SetShareCaptures(shareCaptures);
+  pDMD->SetUseIndexFile(useIndexFile);
+  pDMD->SetQuantizationThresholds(2, s_thresholds2);
+  pDMD->SetQuantizationThresholds(4, s_thresholds4);
+  CHECK(pDMD->Load(dir.string().c_str(), "rom", bitDepth), "Load() of %s failed", dir.string().c_str());
+}
+
+// Every capture matches its own frame in every mode, and its near frame within the tolerance.
+static void TestCaptureFrames(const fs::path& dir, const std::vector<Capture>& captures, Random& random)
+{
+  for (PUPDMD::RegionHashing hashing : {PUPDMD::RegionHashing::Komihash, PUPDMD::RegionHashing::PrefixSum})
+  {
+    PUPDMD::DMD dmd;
+    dmd.SetRegionHashing(hashing);
+    dmd.SetTolerance(2);
+    Load(&dmd, dir, 4, false);
+
+    for (const Capture& capture : captures)
+    {
+      const Frame frame = CaptureFrame(capture, random);
+      const Frame near = NearFrame(capture, random);
+      const uint16_t id = capture.triggerID;
+      const uint16_t w = frame.width;
+      const uint16_t h = frame.height;
+
+      // A fresh session for every call, so repeated triggers are not suppressed.
+      auto match = [&](auto call)
+      {
+        PUPDMD::MatchSession* pSession = dmd.CreateSession();
+        const uint16_t triggerID = call(pSession);
+        dmd.DestroySession(pSession);
+        return triggerID;
+      };
+      CHECK(match([&](auto* s) { return s->Match(frame.rgb.data(), w, h, true); }) == id, "exact color %d", id);
+      CHECK(match([&](auto* s) { return s->Match(frame.rgb.data(), w, h, false); }) == id, "boolean %d", id);
+      CHECK(match([&](auto* s) { return s->MatchIndexed(frame.indexed4.data(), w, h); }) == id, "indexed %d", id);
+      CHECK(match([&](auto* s) { return s->MatchRGB565(frame.rgb565.data(), w, h, true); }) == id, "565 %d", id);
+      CHECK(match([&](auto* s) { return s->MatchRGB565(frame.rgb565.data(), w, h, false); }) == id,
+            "boolean 565 %d", id);
+      CHECK(match([&](auto* s) { return s->Match(near.rgb.data(), w, h, false); }) == id, "tolerant %d", id);
+      CHECK(match([&](auto* s) { return s->MatchIndexed(near.indexed4.data(), w, h); }) == id,
+            "tolerant indexed %d", id);
+    }
+  }
+}
+
+// A capture whose outline is filled with the mask color leaves nothing to compare. It is skipped instead of matching
+// every frame and shadowing the triggers with higher IDs.
+static void TestFilledMask(const fs::path& dir, Random& random)
+{
+  const fs::path filledDir = dir / "filled";
+  std::error_code ec;
+  fs::create_directories(filledDir / "rom" / "PupCapture", ec);
+
+  Capture filled;
+  filled.triggerID = 1;
+  filled.width = 128;
+  filled.height = 32;
+  filled.pixels.assign((size_t)filled.width * filled.height, 0);
+  for (uint16_t y = 2; y < 10; y++)
+  {
+    for (uint16_t x = 4; x < 20; x++) filled.pixels[(size_t)y * filled.width + x] = s_maskColor;
+  }
+  WriteBMP(filledDir / "rom" / "PupCapture" / "1.bmp", filled);
+
+  Capture plain = filled;
+  plain.triggerID = 2;
+  for (uint8_t& pixel : plain.pixels) pixel = (uint8_t)random.Next(s_colorCount);
+  WriteBMP(filledDir / "rom" / "PupCapture" / "2.bmp", plain);
+
+  PUPDMD::DMD dmd;
+  Load(&dmd, filledDir, 4, false);
+  CHECK(dmd.GetTriggers().GetCount() == 1 && !dmd.GetTriggers().Find(1), "the filled mask capture was loaded");
+
+  const Frame frame = CaptureFrame(plain, random);
+  const uint16_t triggerID = dmd.Match(frame.rgb.data(), frame.width, frame.height, false);
+  CHECK(triggerID == 2, "frame of trigger 2 matched %d", triggerID);
+}
+
+// Trigger of a frame on a fresh session, so a repeated trigger is not suppressed.
+static uint16_t MatchOnce(PUPDMD::DMD* pDMD, const Frame& frame)
+{
+  PUPDMD::MatchSession* pSession = pDMD->CreateSession();
+  const uint16_t triggerID = pSession->Match(frame.rgb.data(), frame.width, frame.height, true);
+  pDMD->DestroySession(pSession);
+  return triggerID;
+}
+
+// Reloading a folder with shared captures picks up changed, added and removed captures, with and without the index.
+static void TestReloadChanged(const fs::path& dir, const std::vector<Capture>& captures, Random& random)
+{
+  for (bool useIndexFile : {false, true})
+  {
+    const fs::path reloadDir = dir / "reload";
+    const fs::path captureDir = reloadDir / "rom" / "PupCapture";
+    std::error_code ec;
+    fs::remove_all(reloadDir, ec);
+    fs::create_directories(captureDir, ec);
+
+    // Same resolution and file size for every version of 1.bmp.
+    Capture first = captures[0];
+    Capture changed = captures[5];
+    first.triggerID = changed.triggerID = 1;
+    Capture second = captures[1];
+    second.triggerID = 2;
+    Capture added = captures[2];
+    added.triggerID = 3;
+    const Frame firstFrame = CaptureFrame(first, random);
+    const Frame changedFrame = CaptureFrame(changed, random);
+    const Frame secondFrame = CaptureFrame(second, random);
+    const Frame addedFrame = CaptureFrame(added, random);
+
+    WriteBMP(captureDir / "1.bmp", first);
+    WriteBMP(captureDir / "2.bmp", second);
+    PUPDMD::DMD dmd;
+    Load(&dmd, reloadDir, 4, useIndexFile, true);
+    CHECK(MatchOnce(&dmd, firstFrame) == 1 && MatchOnce(&dmd, secondFrame) == 2, "initial captures do not match");
+
+    // A coarse file system clock could leave the last write time unchanged.
+    const auto mtime = fs::last_write_time(captureDir / "1.bmp", ec);
+    WriteBMP(captureDir / "1.bmp", changed);
+    fs::last_write_time(captureDir / "1.bmp", mtime + std::chrono::seconds(1), ec);
+    WriteBMP(captureDir / "3.bmp", added);
+    fs::remove(captureDir / "2.bmp", ec);
+    Load(&dmd, reloadDir, 4, useIndexFile, true);
+
+    CHECK(MatchOnce(&dmd, changedFrame) == 1, "changed capture does not match after reload, index %d", useIndexFile);
+    CHECK(MatchOnce(&dmd, firstFrame) == 0, "old capture still matches after reload, index %d", useIndexFile);
+    CHECK(MatchOnce(&dmd, addedFrame) == 3, "added capture does not match after reload, index %d", useIndexFile);
+    CHECK(MatchOnce(&dmd, secondFrame) == 0, "removed capture still matches after reload, index %d", useIndexFile);
+    CHECK(dmd.GetTriggers().GetCount() == 2, "%zu triggers after reload", dmd.GetTriggers().GetCount());
+  }
+}
+
+// DMDs loading the same folder share its captures without reading them, identical captures of overlapping folders
+// are stored once, and a DMD that does not share reads the folder again.
+static void TestSharedCaptures(const fs::path& dir, const std::vector<Capture>& captures)
+{
+  const fs::path overlapDir = dir / "overlap";
+  const fs::path captureDir = overlapDir / "rom" / "PupCapture";
+  std::error_code ec;
+  fs::create_directories(captureDir, ec);
+  // The first capture under another trigger ID, and one capture that only this folder has.
+  Capture copy = captures[0];
+  copy.triggerID = 7;
+  WriteBMP(captureDir / "7.bmp", copy);
+  Capture own = captures[0];
+  own.triggerID = 8;
+  std::reverse(own.pixels.begin(), own.pixels.end());
+  WriteBMP(captureDir / "8.bmp", own);
+
+  PUPDMD::DMD first;
+  PUPDMD::DMD second;
+  PUPDMD::DMD overlap;
+  PUPDMD::DMD unshared;
+  Load(&first, dir, 4, false, true);
+  Load(&second, dir, 4, false, true);
+  Load(&overlap, overlapDir, 4, false, true);
+  Load(&unshared, dir, 4, false, false);
+
+  const PUPDMD::Stats stats = second.GetStats();
+  CHECK(stats.loadReadTime == 0 && stats.loadDecodeTime == 0 && stats.loadHashTime == 0,
+        "the second DMD read the shared folder");
+  CHECK(unshared.GetStats().loadDecodeTime > 0, "the DMD without sharing did not read the folder");
+
+  const uint16_t id = captures[0].triggerID;
+  const PUPDMD::Hash* pFirst = first.GetTriggers().Find(id);
+  CHECK(pFirst && pFirst == second.GetTriggers().Find(id), "DMDs on the same folder do not share capture %d", id);
+  CHECK(pFirst && pFirst == overlap.GetTriggers().Find(7), "identical captures of overlapping folders are not shared");
+  CHECK(overlap.GetTriggers().Find(8) && overlap.GetTriggers().Find(8) != pFirst, "different captures are shared");
+}
+
+// A sequence of capture, near, random and repeated frames of every resolution.
+static std::vector<Frame> GenerateSequence(const std::vector<Capture>& captures, Random& random)
+{
+  std::vector<Frame> frames;
+  for (int round = 0; round < 3; round++)
+  {
+    for (const Capture& capture : captures)
+    {
+      switch (random.Next(4))
+      {
+        case 0:
+          frames.push_back(NearFrame(capture, random));
+          break;
+        case 1:
+        {
+          std::vector<uint8_t> colors((size_t)capture.width * capture.height);
+          for (uint8_t& color : colors) color = (uint8_t)random.Next(s_colorCount);
+          frames.push_back(MakeFrame(capture.width, capture.height, std::move(colors)));
+          break;
+        }
+        default:
+          frames.push_back(CaptureFrame(capture, random));
+          break;
+      }
+      if (random.Next(4) == 0) frames.push_back(frames.back());
+    }
+  }
+  return frames;
+}
+
+// The results of every match function for a sequence of frames, in call order.
+static std::vector<uint16_t> MatchSequence(PUPDMD::DMD* pDMD, const std::vector<Frame>& frames, uint8_t bitDepth)
+{
+  std::vector<uint16_t> results;
+  results.reserve(frames.size() * 7);
+  for (const Frame& frame : frames)
+  {
+    const std::vector<uint8_t>& indexed = bitDepth == 4 ? frame.indexed4 : frame.indexed2;
+    results.push_back(pDMD->Match(frame.rgb.data(), frame.width, frame.height, true));
+    results.push_back(pDMD->Match(frame.rgb.data(), frame.width, frame.height, false));
+    results.push_back(pDMD->MatchIndexed(indexed.data(), frame.width, frame.height));
+    results.push_back(pDMD->MatchRGB565(frame.rgb565.data(), frame.width, frame.height, true));
+    results.push_back(pDMD->MatchRGB565(frame.rgb565.data(), frame.width, frame.height, false));
+    results.push_back(pDMD->MatchPalette(frame.colors.data(), &s_colors[0][0], s_colorCount, frame.width,
+                                         frame.height, true));
+    results.push_back(pDMD->MatchPalette(frame.colors.data(), &s_colors[0][0], s_colorCount, frame.width,
+                                         frame.height, false));
+  }
+  return results;
+}
+
+// The counters of GetStats() follow a known frame sequence, ResetStats() clears them.
+static void TestStats(const fs::path& dir, const std::vector<Capture>& captures, Random& random)
+{
+  PUPDMD::DMD dmd;
+  Load(&dmd, dir, 4, false);
+
+  const Frame a = CaptureFrame(captures[0], random);
+  const Frame b = CaptureFrame(captures[1], random);
+  std::vector<uint8_t> colors((size_t)a.width * a.height);
+  for (uint8_t& color : colors) color = (uint8_t)random.Next(s_colorCount);
+  const Frame noise = MakeFrame(a.width, a.height, std::move(colors));
+  const Frame unknown = MakeFrame(100, 20, std::vector<uint8_t>(100 * 20, 3));
+
+  CHECK(dmd.Match(a.rgb.data(), a.width, a.height) == captures[0].triggerID, "first frame did not match");
+  CHECK(dmd.Match(a.rgb.data(), a.width, a.height) == 0, "repeated trigger was reported");
+  CHECK(dmd.Match(b.rgb.data(), b.width, b.height) == captures[1].triggerID, "second frame did not match");
+  CHECK(dmd.Match(noise.rgb.data(), noise.width, noise.height) == 0, "noise frame matched");
+  CHECK(dmd.Match(unknown.rgb.data(), unknown.width, unknown.height) == 0, "frame of unknown resolution matched");
+
+  PUPDMD::Stats stats = dmd.GetStats();
+  uint64_t latencies = 0;
+  for (uint64_t count : stats.latency) latencies += count;
+  CHECK(stats.frames == 5, "frames: %" PRIu64, stats.frames);
+  CHECK(stats.matches == 3, "matches: %" PRIu64, stats.matches);
+  CHECK(stats.suppressedMatches == 1, "suppressed matches: %" PRIu64, stats.suppressedMatches);
+  CHECK(stats.unchangedFrames == 1, "unchanged frames: %" PRIu64, stats.unchangedFrames);
+  CHECK(stats.unknownResolutionFrames == 1, "unknown resolution frames: %" PRIu64, stats.unknownResolutionFrames);
+  CHECK(stats.tolerantMatches == 0, "tolerant matches: %" PRIu64, stats.tolerantMatches);
+  CHECK(latencies == 5, "latency buckets count %" PRIu64 " calls", latencies);
+
+  dmd.ResetStats();
+  stats = dmd.GetStats();
+  latencies = 0;
+  for (uint64_t count : stats.latency) latencies += count;
+  CHECK(stats.frames == 0 && stats.matches == 0 && stats.suppressedMatches == 0 && stats.unchangedFrames == 0 &&
+            latencies == 0,
+        "ResetStats() left counters set");
+}
+
+// A frame one pixel away from a capture shares all bands but one with it. The capture is still compared only once,
+// besides the exact hash lookup.
+static void TestTolerantScan(const fs::path& dir, Random& random)
+{
+  const fs::path bandDir = dir / "band";
+  std::error_code ec;
+  fs::create_directories(bandDir / "rom" / "PupCapture", ec);
+
+  Capture capture;
+  capture.triggerID = 1;
+  capture.width = 128;
+  capture.height = 32;
+  capture.pixels.resize((size_t)capture.width * capture.height);
+  for (uint8_t& pixel : capture.pixels) pixel = (uint8_t)random.Next(s_colorCount);
+  capture.pixels[0] = 0;
+  WriteBMP(bandDir / "rom" / "PupCapture" / "1.bmp", capture);
+
+  PUPDMD::DMD dmd;
+  dmd.SetTolerance(2);
+  Load(&dmd, bandDir, 4, false);
+
+  std::vector<uint8_t> colors = capture.pixels;
+  colors[0] = 6;
+  const Frame frame = MakeFrame(capture.width, capture.height, std::move(colors));
+  const uint16_t triggerID = dmd.Match(frame.rgb.data(), frame.width, frame.height, false);
+  const PUPDMD::Stats stats = dmd.GetStats();
+  CHECK(triggerID == 1, "frame one pixel away matched %d", triggerID);
+  CHECK(stats.triggersScanned == 2, "%" PRIu64 " triggers scanned instead of 2", stats.triggersScanned);
+}
+
+// A frame as RecordingReader should return it.
+struct ExpectedFrame
+{
+  PUPDMD::RecordedCall call;
+  PUPDMD::ColorFormat color;
+  uint16_t width;
+  uint16_t height;
+  std::vector<uint8_t> frame;
+  std::vector<uint8_t> indexedFrame;
+};
+
+static std::vector<uint8_t> Bytes(const std::vector<uint16_t>& values)
+{
+  std::vector<uint8_t> bytes(values.size() * 2);
+  memcpy(bytes.data(), values.data(), bytes.size());
+  return bytes;
+}
+
+// A recording of every match function returns the frames byte for byte. Packed indexed frames come back with one
+// index per byte and palette frames as RGB24.
+static void TestRecording(const fs::path& dir, const std::vector<Frame>& frames)
+{
+  using PUPDMD::ColorFormat;
+  using PUPDMD::RecordedCall;
+
+  const std::string path = (dir / "recording.prec").string();
+  PUPDMD::DMD dmd;
+  Load(&dmd, dir, 4, false);
+  CHECK(dmd.StartRecording(path.c_str()), "StartRecording() failed");
+
+  std::vector<ExpectedFrame> expected;
+  for (int round = 0; round < 4; round++)
+  {
+    for (const Frame& frame : frames)
+    {
+      const uint16_t w = frame.width;
+      const uint16_t h = frame.height;
+      dmd.Match(frame.rgb.data(), w, h, true);
+      expected.push_back({RecordedCall::ExactColor, ColorFormat::RGB24, w, h, frame.rgb, {}});
+      dmd.Match(frame.rgb.data(), w, h, false);
+      expected.push_back({RecordedCall::Boolean, ColorFormat::RGB24, w, h, frame.rgb, {}});
+      dmd.MatchIndexed(frame.indexed4.data(), w, h);
+      expected.push_back({RecordedCall::Indexed, ColorFormat::RGB24, w, h, {}, frame.indexed4});
+      dmd.MatchRGB565(frame.rgb565.data(), w, h, round % 2 == 0);
+      expected.push_back({round % 2 == 0 ? RecordedCall::ExactColor : RecordedCall::Boolean, ColorFormat::RGB565, w,
+                          h, Bytes(frame.rgb565), {}});
+      dmd.MatchPalette(frame.colors.data(), &s_colors[0][0], s_colorCount, w, h, true);
+      expected.push_back({RecordedCall::ExactColor, ColorFormat::RGB24, w, h, frame.rgb, {}});
+      dmd.MatchAll(frame.rgb.data(), round % 2 ? frame.indexed4.data() : nullptr, w, h);
+      expected.push_back({RecordedCall::All, ColorFormat::RGB24, w, h, frame.rgb,
+                          round % 2 ? frame.indexed4 : std::vector<uint8_t>()});
+      if (w % 8 == 0)
+      {
+        const std::vector<uint8_t> packed = PackIndexes(frame.indexed4, 4, false);
+        dmd.MatchIndexed(packed.data(), w, h, PUPDMD::IndexedLayout::Packed4);
+        expected.push_back({RecordedCall::Indexed, ColorFormat::RGB24, w, h, {}, frame.indexed4});
+      }
+    }
+  }
+  dmd.StopRecording();
+
+  PUPDMD::RecordingReader reader;
+  CHECK(reader.Open(path.c_str()), "RecordingReader::Open() failed");
+  PUPDMD::RecordedFrame recorded;
+  size_t count = 0;
+  while (reader.Next(&recorded))
+  {
+    if (count < expected.size())
+    {
+      const ExpectedFrame& frame = expected[count];
+      const bool same =
+          recorded.call == frame.call && recorded.width == frame.width && recorded.height == frame.height &&
+          (frame.frame.empty() || recorded.color == frame.color) &&
+          (frame.frame.empty() ? !recorded.pFrame
+                               : recorded.pFrame && !memcmp(recorded.pFrame, frame.frame.data(), frame.frame.size())) &&
+          (frame.indexedFrame.empty() ? !recorded.pIndexedFrame
+                                      : recorded.pIndexedFrame && !memcmp(recorded.pIndexedFrame,
+                                                                          frame.indexedFrame.data(),
+                                                                          frame.indexedFrame.size()));
+      CHECK(same, "recorded frame %zu differs", count);
+    }
+    count++;
+  }
+  CHECK(count == expected.size(), "%zu of %zu frames read back from the recording", count, expected.size());
+}
+
+// Frame headers that do not fit their call, too large resolutions and too large payloads end the recording.
+static void TestCorruptRecording(const fs::path& dir)
+{
+  struct Case
+  {
+    const char* name;
+    uint32_t size;
+    uint16_t width;
+    uint16_t height;
+    PUPDMD::RecordedCall call;
+    uint8_t planes;  // bit 0: RGB frame, bit 1: indexed frame, bit 2: the RGB frame is RGB565
+  };
+  // The payload of every case is 48 zero bytes, the RGB24 frame of 8x2 pixels.
+  static const Case s_cases[] = {
+      {"indexed call without indexed frame", 2, 8, 2, PUPDMD::RecordedCall::Indexed, 1},
+      {"boolean call with indexed frame", 2, 8, 2, PUPDMD::RecordedCall::Boolean, 3},
+      {"exact color call without RGB frame", 2, 8, 2, PUPDMD::RecordedCall::ExactColor, 2},
+      {"MatchAll() without frames", 2, 8, 2, PUPDMD::RecordedCall::All, 0},
+      {"MatchAll() with RGB565", 2, 8, 2, PUPDMD::RecordedCall::All, 5},
+      {"unknown call", 2, 8, 2, (PUPDMD::RecordedCall)4, 1},
+      {"huge resolution", 2, 65535, 65535, PUPDMD::RecordedCall::ExactColor, 1},
+      {"huge payload", 0xFFFFFFFF, 8, 2, PUPDMD::RecordedCall::ExactColor, 1},
+  };
+
+  const fs::path path = dir / "corrupt.prec";
+  for (const Case& test : s_cases)
+  {
+    {
+      std::ofstream file(path, std::ios::binary | std::ios::trunc);
+      const uint32_t byteOrder = 0x01020304;
+      const uint32_t version = 3;
+      file.write("PREC", 4);
+      file.write(reinterpret_cast<const char*>(&byteOrder), 4);
+      file.write(reinterpret_cast<const char*>(&version), 4);
+
+      // RecordingFrame: timestamp, size, width, height, call, planes.
+      const uint64_t timestamp = 0;
+      const uint8_t call = (uint8_t)test.call;
+      file.write(reinterpret_cast<const char*>(&timestamp), 8);
+      file.write(reinterpret_cast<const char*>(&test.size), 4);
+      file.write(reinterpret_cast<const char*>(&test.width), 2);
+      file.write(reinterpret_cast<const char*>(&test.height), 2);
+      file.write(reinterpret_cast<const char*>(&call), 1);
+      file.write(reinterpret_cast<const char*>(&test.planes), 1);
+      // A run of 48 zero bytes.
+      const uint8_t payload[2] = {0x80 | (48 - 3), 0};
+      file.write(reinterpret_cast<const char*>(payload), sizeof(payload));
+    }
+
+    PUPDMD::RecordingReader reader;
+    PUPDMD::RecordedFrame frame;
+    CHECK(reader.Open(path.string().c_str()), "RecordingReader::Open() of %s failed", test.name);
+    CHECK(!reader.Next(&frame), "frame with %s was read", test.name);
+  }
+
+  // The same file with a valid header is read.
+  std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+  const uint8_t planes = 1;
+  const uint8_t call = (uint8_t)PUPDMD::RecordedCall::ExactColor;
+  file.seekp(12 + 16);
+  file.write(reinterpret_cast<const char*>(&call), 1);
+  file.write(reinterpret_cast<const char*>(&planes), 1);
+  file.seekp(12 + 8);
+  const uint32_t size = 2;
+  file.write(reinterpret_cast<const char*>(&size), 4);
+  file.close();
+  PUPDMD::RecordingReader reader;
+  PUPDMD::RecordedFrame frame;
+  CHECK(reader.Open(path.string().c_str()) && reader.Next(&frame) && frame.width == 8 && frame.height == 2,
+        "valid frame was not read");
+}
+
+// Triggers reported by the async worker. The callback can be held, which stalls the worker.
+struct AsyncTriggers
+{
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<uint16_t> triggerIDs;
+  std::vector<uint64_t> timestamps;
+  bool hold = false;
+
+  static void PUPDMDCALLBACK Callback(uint16_t triggerID, uint64_t timestamp, const void* userData)
+  {
+    AsyncTriggers* pTriggers = (AsyncTriggers*)userData;
+    std::unique_lock<std::mutex> lock(pTriggers->mutex);
+    pTriggers->triggerIDs.push_back(triggerID);
+    pTriggers->timestamps.push_back(timestamp);
+    pTriggers->changed.notify_all();
+    pTriggers->changed.wait(lock, [pTriggers] { return !pTriggers->hold; });
+  }
+
+  // Waits until count triggers are reported, false after a timeout.
+  bool WaitFor(size_t count)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    return changed.wait_for(lock, std::chrono::seconds(10), [&] { return triggerIDs.size() >= count; });
+  }
+
+  void Release()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    hold = false;
+    changed.notify_all();
+  }
+
+  // Every frame is stamped when it is submitted, so the timestamps increase in delivery order.
+  bool Increasing() const
+  {
+    for (size_t i = 0; i < timestamps.size(); i++)
+    {
+      if (timestamps[i] == 0 || (i > 0 && timestamps[i] <= timestamps[i - 1])) return false;
+    }
+    return true;
+  }
+};
+
+// Async frames are matched in submission order while the worker keeps up. If it falls behind, the newest queued frame
+// is replaced. A stopped DMD starts again.
+static void TestAsync(const fs::path& dir, const std::vector<Capture>& captures, Random& random)
+{
+  PUPDMD::DMD dmd;
+  Load(&dmd, dir, 4, false);
+
+  // Consecutive frames of different captures, so no trigger repeats and is suppressed.
+  std::vector<Frame> frames;
+  for (size_t i = 0; i < PUPDMD_ASYNC_SLOTS + 3; i++) frames.push_back(CaptureFrame(captures[i], random));
+  auto submit = [&](size_t i)
+  {
+    CHECK(dmd.SubmitFrame(frames[i].rgb.data(), frames[i].width, frames[i].height, PUPDMD::MatchMode::ExactColor),
+          "SubmitFrame() of frame %zu failed", i);
+  };
+
+  {
+    AsyncTriggers triggers;
+    CHECK(!dmd.StartAsync(&AsyncTriggers::Callback, &triggers, PUPDMD_MAX_WIDTH + 1, 1),
+          "StartAsync() accepted slots wider than PUPDMD_MAX_WIDTH");
+    CHECK(dmd.StartAsync(&AsyncTriggers::Callback, &triggers, frames[0].width, frames[0].height),
+          "StartAsync() failed");
+    // A full ring never replaces a frame.
+    for (size_t i = 0; i < PUPDMD_ASYNC_SLOTS; i++) submit(i);
+    CHECK(triggers.WaitFor(PUPDMD_ASYNC_SLOTS), "%zu of %d async triggers reported", triggers.triggerIDs.size(),
+          PUPDMD_ASYNC_SLOTS);
+    dmd.StopAsync();
+
+    std::vector<uint16_t> expected;
+    for (size_t i = 0; i < PUPDMD_ASYNC_SLOTS; i++) expected.push_back(captures[i].triggerID);
+    CHECK(triggers.triggerIDs == expected, "async triggers reported out of order");
+    CHECK(triggers.Increasing(), "async timestamps are zero or do not increase");
+    CHECK(dmd.GetStats().replacedFrames == 0, "%" PRIu64 " async frames replaced", dmd.GetStats().replacedFrames);
+  }
+
+  {
+    // The held callback of the first frame stalls the worker while the ring fills up. The two frames after that
+    // replace the newest queued one.
+    AsyncTriggers triggers;
+    triggers.hold = true;
+    CHECK(dmd.StartAsync(&AsyncTriggers::Callback, &triggers), "StartAsync() after StopAsync() failed");
+    dmd.ResetStats();
+    submit(0);
+    CHECK(triggers.WaitFor(1), "the first async trigger was not reported");
+    for (size_t i = 1; i < frames.size(); i++) submit(i);
+    triggers.Release();
+    CHECK(triggers.WaitFor(PUPDMD_ASYNC_SLOTS + 1), "%zu async triggers reported after the stall",
+          triggers.triggerIDs.size());
+    dmd.StopAsync();
+
+    std::vector<uint16_t> expected;
+    for (size_t i = 0; i < PUPDMD_ASYNC_SLOTS; i++) expected.push_back(captures[i].triggerID);
+    expected.push_back(captures[frames.size() - 1].triggerID);
+    CHECK(triggers.triggerIDs == expected, "async triggers after the stall differ");
+    CHECK(triggers.Increasing(), "async timestamps after the stall are zero or do not increase");
+    CHECK(dmd.GetStats().replacedFrames == 2, "%" PRIu64 " async frames replaced instead of 2",
+          dmd.GetStats().replacedFrames);
+  }
+}
+
+// Sessions on several threads keep matching correctly while Load() publishes new triggers again and again.
+static void TestConcurrentLoad(const fs::path& dir, const std::vector<Capture>& captures, Random& random)
+{
+  PUPDMD::DMD dmd;
+  Load(&dmd, dir, 4, false);
+
+  // Consecutive frames of different captures, so no trigger repeats and is suppressed.
+  std::vector<Frame> frames;
+  for (const Capture& capture : captures) frames.push_back(CaptureFrame(capture, random));
+
+  std::atomic<bool> loading = true;
+  std::atomic<int> mismatches = 0;
+  std::atomic<uint64_t> matched = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 3; t++)
+  {
+    threads.emplace_back(
+        [&]
+        {
+          PUPDMD::MatchSession* pSession = dmd.CreateSession();
+          do
+          {
+            for (size_t i = 0; i < frames.size(); i++)
+            {
+              const Frame& frame = frames[i];
+              if (pSession->Match(frame.rgb.data(), frame.width, frame.height, true) != captures[i].triggerID)
+                mismatches++;
+              matched++;
+            }
+          } while (loading);
+          dmd.DestroySession(pSession);
+        });
+  }
+
+  for (int i = 0; i < 20; i++) Load(&dmd, dir, 4, false);
+  loading = false;
+  for (auto& thread : threads) thread.join();
+
+  CHECK(mismatches == 0, "%d of %" PRIu64 " frames matched wrong while loading", mismatches.load(), matched.load());
+}
+
+// MatchAll() equals Match(true), Match(false) and MatchIndexed() in this order.
+static void TestMatchAll(const fs::path& dir, const std::vector<Frame>& frames)
+{
+  PUPDMD::DMD all;
+  PUPDMD::DMD separate;
+  Load(&all, dir, 4, false);
+  Load(&separate, dir, 4, false);
+
+  for (const Frame& frame : frames)
+  {
+    const uint16_t w = frame.width;
+    const uint16_t h = frame.height;
+    for (bool indexed : {true, false})
+    {
+      const uint8_t* pIndexed = indexed ? frame.indexed4.data() : nullptr;
+      const PUPDMD::MatchResult result = all.MatchAll(frame.rgb.data(), pIndexed, w, h);
+      const uint16_t exactColor = separate.Match(frame.rgb.data(), w, h, true);
+      const uint16_t boolean = separate.Match(frame.rgb.data(), w, h, false);
+      const uint16_t indexedID = indexed ? separate.MatchIndexed(pIndexed, w, h) : 0;
+      CHECK(result.exactColorTriggerID == exactColor && result.booleanTriggerID == boolean &&
+                result.indexedTriggerID == indexedID,
+            "MatchAll() %d/%d/%d, separate calls %d/%d/%d", result.exactColorTriggerID, result.booleanTriggerID,
+            result.indexedTriggerID, exactColor, boolean, indexedID);
+    }
+  }
+}
+
+// MatchBatch() equals matching the frames one by one, on one thread and on several.
+static void TestMatchBatch(const fs::path& dir, const std::vector<Frame>& frames)
+{
+  for (uint8_t threads : {1, 4})
+  {
+    PUPDMD::DMD batch;
+    PUPDMD::DMD single;
+    Load(&batch, dir, 4, false);
+    Load(&single, dir, 4, false);
+
+    for (PUPDMD::MatchMode mode :
+         {PUPDMD::MatchMode::ExactColor, PUPDMD::MatchMode::Boolean, PUPDMD::MatchMode::Indexed})
+    {
+      // Frames of one resolution back to back, in sequence order.
+      for (size_t first = 0; first < frames.size();)
+      {
+        size_t last = first;
+        while (last < frames.size() && frames[last].width == frames[first].width &&
+               frames[last].height == frames[first].height)
+          last++;
+
+        const uint16_t w = frames[first].width;
+        const uint16_t h = frames[first].height;
+        std::vector<uint8_t> data;
+        std::vector<uint16_t> expected;
+        for (size_t i = first; i < last; i++)
+        {
+          const Frame& frame = frames[i];
+          if (mode == PUPDMD::MatchMode::Indexed)
+          {
+            data.insert(data.end(), frame.indexed4.begin(), frame.indexed4.end());
+            expected.push_back(single.MatchIndexed(frame.indexed4.data(), w, h));
+          }
+          else
+          {
+            data.insert(data.end(), frame.rgb.begin(), frame.rgb.end());
+            expected.push_back(single.Match(frame.rgb.data(), w, h, mode == PUPDMD::MatchMode::ExactColor));
+          }
+        }
+
+        std::vector<uint16_t> triggerIDs(expected.size(), 0);
+        batch.MatchBatch(data.data(), (uint32_t)expected.size(), w, h, mode, triggerIDs.data(), threads);
+        CHECK(triggerIDs == expected, "MatchBatch() of %zu frames on %d threads, mode %d", expected.size(), threads,
+              (int)mode);
+        first = last;
+      }
+    }
+  }
+}
+
+static void PUPDMDCALLBACK CountPackedWidthLog(const char* format, va_list, const void* userData)
+{
+  if (strstr(format, "multiple of 8")) (*(int*)userData)++;
+}
+
+// Packed and planar indexed frames equal the same frame with one index per byte.
+static void TestIndexedLayouts(const fs::path& dir, const std::vector<Frame>& frames)
+{
+  using PUPDMD::IndexedLayout;
+  for (uint8_t bitDepth : {2, 4})
+  {
+    const IndexedLayout packed = bitDepth == 2 ? IndexedLayout::Packed2 : IndexedLayout::Packed4;
+    const IndexedLayout planes = bitDepth == 2 ? IndexedLayout::Planes2 : IndexedLayout::Planes4;
+    for (PUPDMD::IndexedLayout layout : {packed, planes})
+    {
+      PUPDMD::DMD packedDMD;
+      PUPDMD::DMD bytesDMD;
+      Load(&packedDMD, dir, bitDepth, false);
+      Load(&bytesDMD, dir, bitDepth, false);
+
+      for (const Frame& frame : frames)
+      {
+        // The packed layouts need a width that is a multiple of 8.
+        if (frame.width % 8) continue;
+
+        const std::vector<uint8_t>& indexed = bitDepth == 4 ? frame.indexed4 : frame.indexed2;
+        const std::vector<uint8_t> data = PackIndexes(indexed, bitDepth, layout == planes);
+        const uint16_t packedID = packedDMD.MatchIndexed(data.data(), frame.width, frame.height, layout);
+        const uint16_t bytesID = bytesDMD.MatchIndexed(indexed.data(), frame.width, frame.height);
+        CHECK(packedID == bytesID, "layout %d: %d, bytes: %d", (int)layout, packedID, bytesID);
+      }
+    }
+  }
+
+  // Other widths never match a packed layout, and the first such frame of a session is logged.
+  PUPDMD::DMD dmd;
+  Load(&dmd, dir, 4, false);
+  int logged = 0;
+  dmd.SetLogCallback(&CountPackedWidthLog, &logged);
+  const Frame& frame = frames.front();
+  const std::vector<uint8_t> data = PackIndexes(frame.indexed4, 4, false);
+  const uint16_t narrowID = dmd.MatchIndexed(data.data(), frame.width - 1, frame.height, IndexedLayout::Packed4);
+  dmd.MatchIndexed(data.data(), frame.width - 1, frame.height, IndexedLayout::Packed4);
+  CHECK(narrowID == 0 && logged == 1, "packed frame of width %d matched %d, logged %d times", frame.width - 1,
+        narrowID, logged);
+}
+
+// Prefix sums find the same triggers as komihash, exactly and within a tolerance.
+static void TestPrefixSums(const fs::path& dir, const std::vector<Frame>& frames)
+{
+  for (uint16_t tolerance : {0, 2})
+  {
+    PUPDMD::DMD komihash;
+    PUPDMD::DMD prefixSum;
+    komihash.SetTolerance(tolerance);
+    prefixSum.SetTolerance(tolerance);
+    prefixSum.SetRegionHashing(PUPDMD::RegionHashing::PrefixSum);
+    Load(&komihash, dir, 4, false);
+    Load(&prefixSum, dir, 4, false);
+
+    CHECK(MatchSequence(&prefixSum, frames, 4) == MatchSequence(&komihash, frames, 4),
+          "prefix sums differ from komihash, tolerance %d", tolerance);
+  }
+}
+
+// Captures loaded from the index file equal the ones decoded from the BMPs and match the same.
+static void TestIndexFile(const fs::path& dir, const std::vector<Frame>& frames)
+{
+  const fs::path indexPath = dir / "rom" / "PupCapture" / PUPDMD_INDEX_FILE_NAME;
+  std::error_code ec;
+  fs::remove(indexPath, ec);
+
+  PUPDMD::DMD bmps;
+  bmps.SetTolerance(2);
+  Load(&bmps, dir, 4, true);
+  CHECK(fs::exists(indexPath, ec), "no index file written");
+
+  PUPDMD::DMD indexed;
+  indexed.SetTolerance(2);
+  Load(&indexed, dir, 4, true);
+  CHECK(indexed.GetStats().loadDecodeTime == 0, "the captures were decoded instead of read from the index file");
+
+  PUPDMD::TriggerView bmpTriggers = bmps.GetTriggers();
+  PUPDMD::TriggerView indexTriggers = indexed.GetTriggers();
+  CHECK(bmpTriggers.GetCount() == indexTriggers.GetCount(), "%zu triggers from the BMPs, %zu from the index file",
+        bmpTriggers.GetCount(), indexTriggers.GetCount());
+  for (const auto& pair : bmpTriggers)
+  {
+    const PUPDMD::Hash* pHash = indexTriggers.Find(pair.first);
+    CHECK(pHash && SameHash(pair.second, *pHash), "trigger %d differs in the index file", pair.first);
+  }
+
+  CHECK(MatchSequence(&indexed, frames, 4) == MatchSequence(&bmps, frames, 4),
+        "captures of the index file match differently");
+
+  const fs::path emptyDir = dir / "empty";
+  fs::create_directories(emptyDir / "rom" / "PupCapture", ec);
+  PUPDMD::DMD empty;
+  Load(&empty, emptyDir, 4, true);
+  CHECK(!fs::exists(emptyDir / "rom" / "PupCapture" / PUPDMD_INDEX_FILE_NAME, ec),
+        "index file written for a folder without captures");
+}
+
+int main()
+{
+  const fs::path dir = fs::temp_directory_path() / "pupdmd_tests";
+  const fs::path captureDir = dir / "rom" / "PupCapture";
+  std::error_code ec;
+  fs::remove_all(dir, ec);
+  fs::create_directories(captureDir, ec);
+
+  Random random;
+  const std::vector<Capture> captures = GenerateCaptures(random);
+  for (const Capture& capture : captures)
+    WriteBMP(captureDir / (std::to_string(capture.triggerID) + ".bmp"), capture);
+  const std::vector<Frame> frames = GenerateSequence(captures, random);
+
+  TestCaptureFrames(dir, captures, random);
+  TestFilledMask(dir, random);
+  TestStats(dir, captures, random);
+  TestTolerantScan(dir, random);
+  TestReloadChanged(dir, captures, random);
+  TestSharedCaptures(dir, captures);
+  TestAsync(dir, captures, random);
+  TestConcurrentLoad(dir, captures, random);
+  TestMatchAll(dir, frames);
+  TestMatchBatch(dir, frames);
+  TestIndexedLayouts(dir, frames);
+  TestPrefixSums(dir, frames);
+  TestIndexFile(dir, frames);
+  TestRecording(dir, frames);
+  TestCorruptRecording(dir);
+
+  fs::remove_all(dir, ec);
+
+  if (s_failures)
+  {
+    printf("%d checks failed\n", s_failures);
+    return 1;
+  }
+  printf("All checks passed, %zu captures, %zu frames\n", captures.size(), frames.size());
+  return 0;
+}